@@ -86,7 +86,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -226,7 +226,7 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer)
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_READ_SECTOR_RETRY);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
@@ -252,7 +252,7 @@ disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
   c = d->channel;
   
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
   if (!wait_while_busy (d))
     PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -261,6 +261,45 @@ disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
   d->write_cnt++;
   lock_release (&c->lock);
 }
+
+/* Writes the CNT sectors starting at SEC_NO to disk D with a
+   single command, taking sector SEC_NO + I from BUFFERS[I], which
+   must contain DISK_SECTOR_SIZE bytes.  CNT must be between 1 and
+   DISK_MULTIPLE_MAX.  Returns after the disk has acknowledged
+   receiving all of the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                     const void *const buffers[])
+{
+  struct channel *c;
+  size_t i;
+
+  ASSERT (d != NULL);
+  ASSERT (buffers != NULL);
+  ASSERT (cnt > 0 && cnt <= DISK_MULTIPLE_MAX);
+
+  c = d->channel;
+
+  lock_acquire (&c->lock);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      /* The disk interrupts as it takes each sector after the
+         first, and once more when the last is written. */
+      if (i > 0)
+        sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + i);
+      output_sector (c, buffers[i]);
+    }
+  sema_down (&c->completion_wait);
+  d->write_cnt += cnt;
+  lock_release (&c->lock);
+}
 
 /* Disk detection and identification. */
 
@@ -427,19 +466,20 @@ print_ata_string (char *string, size_t size)
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection and sector
+   count registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) 
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) 
 {
 //  printf("select_sector, sec_no is %d\n", sec_no);
   struct channel *c = d->channel;
   
-  ASSERT (sec_no < d->capacity);
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= DISK_MULTIPLE_MAX);
+  ASSERT (sec_no + cnt <= d->capacity);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt & 0xff);     /* 0 means 256. */
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -0,0 +1,250 @@
+/* fsbench.c
+
+   Runs one of a few fixed file system workloads and prints how
+   far each fsstat counter moved while it ran, so that two
+   kernels can be compared on the same work.
+   Usage: fsbench WORKLOAD [COUNT].  Run it with no arguments
+   for the list of workloads.
+   This won't work until project 4. */
+
+#include <syscall.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *class_names[FSSTAT_CLASS_CNT] =
+  {"inode", "indirect", "dir", "freemap", "data"};
+
+/* Counters printed besides the per-class hits and misses. */
+#define COUNTER(NAME) {#NAME, offsetof (struct fsstat, NAME)}
+static const struct
+  {
+    const char *name;
+    size_t ofs;
+  }
+counters[] =
+  {
+    COUNTER (read_fills), COUNTER (write_fills), COUNTER (fill_skips),
+    COUNTER (read_aheads), COUNTER (evictions), COUNTER (writebacks),
+    COUNTER (inode_opens), COUNTER (inode_reopens),
+    COUNTER (inode_revives), COUNTER (bytes_read), COUNTER (hole_bytes),
+    COUNTER (bytes_written), COUNTER (extends),
+    COUNTER (dentry_hits), COUNTER (dentry_negative_hits),
+    COUNTER (dentry_misses),
+    COUNTER (journal_commits), COUNTER (journal_blocks),
+    COUNTER (journal_revokes), COUNTER (journal_checkpoints),
+  };
+
+static char block[512];
+
+/* Exits with a message naming WHAT unless OK. */
+static void
+must (bool ok, const char *what)
+{
+  if (!ok)
+    {
+      printf ("fsbench: %s failed\n", what);
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Creates CNT files of 16 sectors each, written a sector at a
+   time, then removes them all.  Every write that extends a file
+   allocates, and every remove frees, so this mostly exercises
+   the free map. */
+static void
+run_freemap (int cnt)
+{
+  char name[16];
+  int i, j, fd;
+
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb%d", i);
+      must (create (name, 0), "create");
+      must ((fd = open (name)) > 1, "open");
+      for (j = 0; j < 16; j++)
+        must (write (fd, block, sizeof block) == sizeof block, "write");
+      close (fd);
+    }
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb%d", i);
+      must (remove (name), "remove");
+    }
+}
+
+/* Appends CNT sectors to each of two files in turn, so that
+   without preallocation their blocks would interleave on disk and
+   each file would need an extent or indirect entry per block. */
+static void
+run_twofiles (int cnt)
+{
+  int fd[2];
+  int i, j;
+
+  must (create ("fsb-a", 0) && create ("fsb-b", 0), "create");
+  must ((fd[0] = open ("fsb-a")) > 1 && (fd[1] = open ("fsb-b")) > 1,
+        "open");
+  for (i = 0; i < cnt; i++)
+    for (j = 0; j < 2; j++)
+      must (write (fd[j], block, sizeof block) == sizeof block, "write");
+  for (j = 0; j < 2; j++)
+    close (fd[j]);
+  must (remove ("fsb-a") && remove ("fsb-b"), "remove");
+}
+
+/* Creates CNT files, then opens and closes each of them ten
+   times over.  Between rounds every file is closed, so each open
+   finds the inode either in memory or only on disk. */
+static void
+run_reopen (int cnt)
+{
+  char name[16];
+  int round, i, fd;
+
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb%d", i);
+      must (create (name, 0), "create");
+    }
+  for (round = 0; round < 10; round++)
+    for (i = 0; i < cnt; i++)
+      {
+        snprintf (name, sizeof name, "fsb%d", i);
+        must ((fd = open (name)) > 1, "open");
+        close (fd);
+      }
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb%d", i);
+      must (remove (name), "remove");
+    }
+}
+
+/* In a new directory, creates CNT empty files, opens each of
+   them once, then removes them all and the directory. */
+static void
+run_bigdir (int cnt)
+{
+  char name[32];
+  int i, fd;
+
+  must (mkdir ("fsb-dir"), "mkdir");
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb-dir/f%d", i);
+      must (create (name, 0), "create");
+    }
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb-dir/f%d", i);
+      must ((fd = open (name)) > 1, "open");
+      close (fd);
+    }
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "fsb-dir/f%d", i);
+      must (remove (name), "remove");
+    }
+  must (remove ("fsb-dir"), "remove");
+}
+
+/* Opens a file three directories deep CNT times by its full
+   path, then looks up a name that does not exist as often. */
+static void
+run_paths (int cnt)
+{
+  int i, fd;
+
+  must (mkdir ("fsb-a") && mkdir ("fsb-a/b") && mkdir ("fsb-a/b/c"),
+        "mkdir");
+  must (create ("fsb-a/b/c/f", 0), "create");
+  for (i = 0; i < cnt; i++)
+    {
+      must ((fd = open ("fsb-a/b/c/f")) > 1, "open");
+      close (fd);
+      must (open ("fsb-a/b/c/g") == -1, "open of a missing file");
+    }
+  must (remove ("fsb-a/b/c/f") && remove ("fsb-a/b/c")
+        && remove ("fsb-a/b") && remove ("fsb-a"), "remove");
+}
+
+/* Workloads, by name. */
+static const struct workload
+  {
+    const char *name;
+    void (*run) (int cnt);
+    int default_cnt;
+    const char *description;
+  }
+workloads[] =
+  {
+    {"freemap", run_freemap, 50,
+     "create COUNT 8 kB files a sector at a time, then remove them"},
+    {"twofiles", run_twofiles, 1000,
+     "append COUNT sectors to each of two files in turn"},
+    {"reopen", run_reopen, 20,
+     "create COUNT files, then open and close each ten times"},
+    {"bigdir", run_bigdir, 1000,
+     "create, open and remove COUNT files in one directory"},
+    {"paths", run_paths, 1000,
+     "open a path three directories deep COUNT times"},
+  };
+
+#define WORKLOAD_CNT (sizeof workloads / sizeof *workloads)
+
+/* Prints the counters that differ between BEFORE and AFTER. */
+static void
+print_delta (const struct fsstat *before, const struct fsstat *after)
+{
+  size_t i;
+
+  for (i = 0; i < FSSTAT_CLASS_CNT; i++)
+    if (after->hits[i] != before->hits[i]
+        || after->misses[i] != before->misses[i])
+      printf ("  %-8s %10lld hits %10lld misses\n", class_names[i],
+              after->hits[i] - before->hits[i],
+              after->misses[i] - before->misses[i]);
+  for (i = 0; i < sizeof counters / sizeof *counters; i++)
+    {
+      long long b = *(const long long *) ((const char *) before
+                                          + counters[i].ofs);
+      long long a = *(const long long *) ((const char *) after
+                                          + counters[i].ofs);
+      if (a != b)
+        printf ("  %-20s %10lld\n", counters[i].name, a - b);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct fsstat before, after;
+  const struct workload *w = NULL;
+  size_t i;
+  int cnt;
+
+  if (argc >= 2)
+    for (i = 0; i < WORKLOAD_CNT; i++)
+      if (!strcmp (argv[1], workloads[i].name))
+        w = &workloads[i];
+  if (w == NULL || argc > 3)
+    {
+      printf ("usage: fsbench WORKLOAD [COUNT]\n");
+      for (i = 0; i < WORKLOAD_CNT; i++)
+        printf ("  %-8s %s (COUNT=%d)\n", workloads[i].name,
+                workloads[i].description, workloads[i].default_cnt);
+      return EXIT_FAILURE;
+    }
+  cnt = argc == 3 ? atoi (argv[2]) : w->default_cnt;
+
+  must (fsstat (&before), "fsstat");
+  w->run (cnt);
+  must (fsstat (&after), "fsstat");
+
+  printf ("%s %d:\n", w->name, cnt);
+  print_delta (&before, &after);
+  return EXIT_SUCCESS;
+}
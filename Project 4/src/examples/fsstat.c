@@ -0,0 +1,52 @@
+/* fsstat.c
+
+   Prints the file system's buffer cache, inode and journal
+   statistics.
+   This won't work until project 4. */
+
+#include <syscall.h>
+#include <stdio.h>
+
+static const char *class_names[FSSTAT_CLASS_CNT] =
+  {"inode", "indirect", "dir", "freemap", "data"};
+
+int
+main (void) 
+{
+  struct fsstat st;
+  long long hits = 0, misses = 0;
+  int i;
+
+  if (!fsstat (&st))
+    {
+      printf ("fsstat: failed\n");
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < FSSTAT_CLASS_CNT; i++)
+    {
+      hits += st.hits[i];
+      misses += st.misses[i];
+    }
+  printf ("cache: %d sectors, %lld hits, %lld misses\n",
+          st.cache_sectors, hits, misses);
+  for (i = 0; i < FSSTAT_CLASS_CNT; i++)
+    printf ("  %-8s %10lld hits %10lld misses\n",
+            class_names[i], st.hits[i], st.misses[i]);
+  printf ("cache: %lld reads (%lld for partial writes), "
+          "%lld writes not read, %lld read-aheads\n",
+          st.read_fills, st.write_fills, st.fill_skips, st.read_aheads);
+  printf ("cache: %lld evictions, %lld writebacks\n",
+          st.evictions, st.writebacks);
+  printf ("inodes: %lld opens, %lld reopens, %lld revived, %lld extensions\n",
+          st.inode_opens, st.inode_reopens, st.inode_revives, st.extends);
+  printf ("inodes: %lld bytes read (%lld from holes), %lld bytes written\n",
+          st.bytes_read, st.hole_bytes, st.bytes_written);
+  printf ("dentries: %lld hits (%lld negative), %lld misses\n",
+          st.dentry_hits, st.dentry_negative_hits, st.dentry_misses);
+  printf ("journal: %lld commits, %lld blocks logged, %lld revoked, "
+          "%lld checkpoints, %lld replayed at mount\n",
+          st.journal_commits, st.journal_blocks, st.journal_revokes,
+          st.journal_checkpoints, st.journal_replays);
+  return EXIT_SUCCESS;
+}
@@ -1,5 +1,110 @@
 #include "filesys/cache.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+
+/* Initial cache size in sectors; -cache=SECTORS on the command line. */
+int buffer_init_size = CACHE_SIZE;
+
+/* Replacement policy; -cache-policy=clock|2q on the command line. */
+enum buffer_policy buffer_policy = BUFFER_2Q;
+
+/* Leave the blocks that the journal logs to eviction and to
+   checkpoints instead of writing them back in the background?
+   Set by -crash, so that the transactions committed before the
+   crash are all still in the log when it is replayed. */
+bool buffer_hold_metadata;
+
+/* Cache statistics.  Only the buffer cache fields are used here;
+   the rest belong to the inode layer.  Protected by buffer_lock. */
+static struct fsstat buffer_stats;
+
+/* Class under which read_ahead_daemon() acquires blocks: its misses
+   are counted as read-aheads, and its hits not at all. */
+#define CLASS_READ_AHEAD FSSTAT_CLASS_CNT
+
+/* Index from sector number to the slot caching it, so that a lookup
+   does not have to walk the whole buffer_cache[].  Sized for
+   buffer_capacity at boot. */
+static struct list * buffer_hash;
+static int buffer_hash_cnt;
+
+/* Slots that hold no sector yet.  Filled before we start evicting. */
+static struct list buffer_free_list;
+
+/* Signaled whenever some block becomes idle, for threads that
+   found every block in use. */
+static struct condition buffer_avail;
+
+/* Sectors queued by buffer_read_ahead(), fetched in the background
+   by read_ahead_daemon().  A ring; ra_head is the oldest entry. */
+static disk_sector_t read_ahead_queue[READ_AHEAD_QUEUE];
+static int ra_head;
+static int ra_count;
+static struct lock read_ahead_lock;
+static struct semaphore read_ahead_sema;    /* Up'd once per queued sector. */
+
+static void read_ahead_daemon(void *);
+
+/* Number of dirty blocks, for the write-behind thread. */
+static int dirty_cnt;
+
+/* Number of blocks held for the journal, in a state other than
+   JOURNAL_NONE. */
+static int journal_cnt;
+
+/* Most blocks the journal has been told it may hold at once, by
+   buffer_journal_room().  The cache never shrinks below room for
+   them. */
+static int journal_room;
+
+static void write_behind_daemon(void *);
+
+/* Blocks being written by buffer_flush(), buffer_capacity
+   entries.  flush_lock keeps flushes from sharing it; it is
+   always acquired before buffer_lock. */
+static struct buffcache_elem ** flush_list;
+static struct lock flush_lock;
+
+/* 2Q queues.  twoq_in (A1in) holds blocks not referenced again
+   since they were loaded, oldest at the back; twoq_main (Am)
+   holds blocks referenced again, least recently used at the
+   back.  Only kept under BUFFER_2Q. */
+static struct list twoq_in;
+static struct list twoq_main;
+static int twoq_in_cnt;
+
+/* A1out: sectors recently dropped from twoq_in, without data.
+   Looked up through ghost_hash, which is bucketed like
+   buffer_hash, and aged out of ghost_fifo, newest at the front. */
+struct buffer_ghost
+{
+  disk_sector_t sector;
+  struct list_elem hash_elem;   /* Element in a ghost_hash bucket. */
+  struct list_elem fifo_elem;   /* Element in ghost_fifo or ghost_free. */
+};
+static struct buffer_ghost * ghosts;
+static struct list * ghost_hash;
+static struct list ghost_fifo;
+static struct list ghost_free;
+static int ghost_cnt;
+
+static bool buffer_grow(void);
+static void twoq_remove(struct buffcache_elem *, bool);
+
+static struct list *
+buffer_bucket(disk_sector_t sector)
+{
+  return &buffer_hash[sector % buffer_hash_cnt];
+}
 
 void
 buffer_init()
@@ -8,205 +113,1074 @@ buffer_init()
   int i;
   struct buffcache_elem * e;
 
+  if(buffer_init_size < CACHE_PAGE_SECTORS)
+    buffer_init_size = CACHE_PAGE_SECTORS;
+  buffer_init_size = ROUND_UP(buffer_init_size, CACHE_PAGE_SECTORS);
+  buffer_capacity = buffer_init_size > CACHE_MAX_SIZE ? buffer_init_size : CACHE_MAX_SIZE;
+
+  buffer_cache = malloc(buffer_capacity * sizeof *buffer_cache);
+  buffer_hash_cnt = buffer_capacity / CACHE_HASH_LOAD;
+  buffer_hash = malloc(buffer_hash_cnt * sizeof *buffer_hash);
+  flush_list = malloc(buffer_capacity * sizeof *flush_list);
+  if(buffer_cache == NULL || buffer_hash == NULL || flush_list == NULL)
+    PANIC("buffer_init: out of memory");
+
   lock_init(&buffer_lock);
-  for(i=0; i<CACHE_SIZE; i++)
+  lock_init(&flush_lock);
+  for(i=0; i<buffer_hash_cnt; i++)
+    list_init(&buffer_hash[i]);
+  list_init(&buffer_free_list);
+  cond_init(&buffer_avail);
+
+  list_init(&twoq_in);
+  list_init(&twoq_main);
+  twoq_in_cnt = 0;
+  list_init(&ghost_fifo);
+  list_init(&ghost_free);
+  ghost_cnt = 0;
+  if(buffer_policy == BUFFER_2Q)
+  {
+    int ghost_max = buffer_capacity * TWOQ_OUT_PERCENT / 100;
+
+    ghosts = malloc(ghost_max * sizeof *ghosts);
+    ghost_hash = malloc(buffer_hash_cnt * sizeof *ghost_hash);
+    if(ghosts == NULL || ghost_hash == NULL)
+      PANIC("buffer_init: out of memory");
+    for(i=0; i<buffer_hash_cnt; i++)
+      list_init(&ghost_hash[i]);
+    for(i=0; i<ghost_max; i++)
+      list_push_back(&ghost_free, &ghosts[i].fifo_elem);
+  }
+
+  for(i=0; i<buffer_capacity; i++)
   {
     e = &buffer_cache[i];
-    e->is_deleted = true;
-    e->access = false;
-    e->dirty = false;
-    e->sector = -1;
+    e->data = NULL;
+    e->readers = 0;
+    e->writer = false;
+    e->io_busy = false;
+    e->queue = QUEUE_NONE;
+    e->journal = JOURNAL_NONE;
+    e->jseq = 0;
+    cond_init(&e->cond);
   }
   hand = 0;
+
+  buffer_size = 0;
+  lock_acquire(&buffer_lock);
+  while(buffer_size < buffer_init_size && buffer_grow())
+    continue;
+  lock_release(&buffer_lock);
+  if(buffer_size == 0)
+    PANIC("buffer_init: no pages for the buffer cache");
+
+  lock_init(&read_ahead_lock);
+  sema_init(&read_ahead_sema, 0);
+  ra_head = ra_count = 0;
+  thread_create("read-ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+
+  dirty_cnt = 0;
+  journal_cnt = 0;
+  thread_create("write-behind", PRI_DEFAULT, write_behind_daemon, NULL);
 //  printf("buffer_init end\n");
 }
 
+/* Returns the index of the slot caching SECTOR, or NO_HIT. */
 int
 buffer_find(disk_sector_t sector)
 {
-  int i;
+  struct list * bucket = buffer_bucket(sector);
+  struct list_elem * le;
   struct buffcache_elem * e;
-  
-//  printf("in buffer_find hand is %d sector is %d\n", hand, sector);
-  
 
-  for(i=0; i<CACHE_SIZE; i++)
+  for(le = list_begin(bucket); le != list_end(bucket); le = list_next(le))
   {
-    e = &buffer_cache[i];
-//    printf("i is %d, e->sector is %d\n",i, e->sector);
-    if(e->sector == sector || e->is_deleted)
-      return i;
+    e = list_entry(le, struct buffcache_elem, hash_elem);
+    if(e->sector == sector)
+      return e - buffer_cache;
   }
-//  printf("for loop end\n");  
   return NO_HIT;
 }
 
-void
-buffer_read(disk_sector_t sector, void * data, int offset, int size)
+/* Returns true if nobody holds E and no transfer is pending on
+   it, so that it may be handed to another sector. */
+static bool
+buffer_idle(struct buffcache_elem * e)
 {
-//  printf("buffer read\n");
-  lock_acquire(&buffer_lock);
-  int target_index = buffer_find(sector);
-  struct buffcache_elem * e;
+  return e->readers == 0 && !e->writer && !e->io_busy;
+}
+
+/* Returns true if E is idle and the journal does not hold it, so
+   that it may be written back and handed to another sector. */
+static bool
+buffer_evictable(struct buffcache_elem * e)
+{
+  return buffer_idle(e) && e->journal == JOURNAL_NONE;
+}
+
+/* Picks a slot to hold a new sector: a never-used slot if there
+   is one, otherwise an idle victim chosen by buffer_evict().  The
+   victim may still be dirty.  Returns a null pointer if every
+   slot is in use. */
+static struct buffcache_elem *
+buffer_alloc(void)
+{
+  int victim;
+
+  if(!list_empty(&buffer_free_list))
+    return list_entry(list_pop_front(&buffer_free_list), struct buffcache_elem, free_elem);
+
+  victim = buffer_evict();
+  return victim == -1 ? NULL : &buffer_cache[victim];
+}
+
+/* Forgets SECTOR's ghost, if it has one.  Returns true if it
+   did. */
+static bool
+ghost_take(disk_sector_t sector)
+{
+  struct list * bucket = &ghost_hash[sector % buffer_hash_cnt];
+  struct list_elem * le;
+  struct buffer_ghost * g;
 
-  if(target_index == NO_HIT)
+  for(le = list_begin(bucket); le != list_end(bucket); le = list_next(le))
   {
-//    printf("in buffer_read NO_HIt\n");
-    target_index = buffer_evict();
-    e = &buffer_cache[target_index];
+    g = list_entry(le, struct buffer_ghost, hash_elem);
+    if(g->sector == sector)
+    {
+      list_remove(&g->hash_elem);
+      list_remove(&g->fifo_elem);
+      list_push_front(&ghost_free, &g->fifo_elem);
+      ghost_cnt--;
+      return true;
+    }
+  }
+  return false;
+}
 
-    e->sector = sector;
-    e->is_deleted = false;
-    e->access = false;
-    e->dirty = false;
-    disk_read(filesys_disk, sector, e->data);
+/* Remembers SECTOR as a ghost, forgetting the oldest ghosts to
+   stay within TWOQ_OUT_PERCENT of the current cache size. */
+static void
+ghost_add(disk_sector_t sector)
+{
+  int limit = buffer_size * TWOQ_OUT_PERCENT / 100;
+  struct buffer_ghost * g;
+
+  while(ghost_cnt > 0 && (ghost_cnt >= limit || list_empty(&ghost_free)))
+  {
+    g = list_entry(list_pop_back(&ghost_fifo), struct buffer_ghost, fifo_elem);
+    list_remove(&g->hash_elem);
+    list_push_front(&ghost_free, &g->fifo_elem);
+    ghost_cnt--;
   }
-  else if(buffer_cache[target_index].is_deleted)
+  if(limit == 0 || list_empty(&ghost_free))
+    return;
+
+  g = list_entry(list_pop_front(&ghost_free), struct buffer_ghost, fifo_elem);
+  g->sector = sector;
+  list_push_front(&ghost_fifo, &g->fifo_elem);
+  list_push_front(&ghost_hash[sector % buffer_hash_cnt], &g->hash_elem);
+  ghost_cnt++;
+}
+
+/* Queues E, just loaded: on Am if its sector left A1in only
+   recently, on A1in otherwise. */
+static void
+twoq_insert(struct buffcache_elem * e)
+{
+  ASSERT(e->queue == QUEUE_NONE);
+  if(ghost_take(e->sector))
+  {
+    e->queue = QUEUE_MAIN;
+    list_push_front(&twoq_main, &e->queue_elem);
+  }
+  else
   {
-//    printf("in buffer_read deleted \n");
-    e = &buffer_cache[target_index];
+    e->queue = QUEUE_IN;
+    list_push_front(&twoq_in, &e->queue_elem);
+    twoq_in_cnt++;
+  }
+}
 
-    e->sector = sector;
-    e->is_deleted = false;
-    e->access = false;
-    e->dirty = false;
-    disk_read(filesys_disk, sector, e->data);
+/* Takes E off its queue.  A block leaving A1in leaves a ghost
+   behind if GHOST. */
+static void
+twoq_remove(struct buffcache_elem * e, bool ghost)
+{
+  if(e->queue == QUEUE_NONE)
+    return;
+  list_remove(&e->queue_elem);
+  if(e->queue == QUEUE_IN)
+  {
+    twoq_in_cnt--;
+    if(ghost)
+      ghost_add(e->sector);
   }
-  else // cache hit
+  e->queue = QUEUE_NONE;
+}
+
+/* Notes a hit on E.  Hits in A1in are not counted, so that a burst
+   of accesses right after a load does not make a block hot. */
+static void
+twoq_touch(struct buffcache_elem * e)
+{
+  if(e->queue == QUEUE_MAIN)
   {
-//    printf("cache hit\n");
-    e = &buffer_cache[target_index];
+    list_remove(&e->queue_elem);
+    list_push_front(&twoq_main, &e->queue_elem);
   }
-  e->access = true;
-  memcpy(data, e->data + offset, size);
-  lock_release(&buffer_lock);
+}
 
+/* Re-indexes slot E under SECTOR.  E's data is not filled in. */
+static void
+buffer_install(struct buffcache_elem * e, disk_sector_t sector)
+{
+  if(!e->is_deleted)
+  {
+    list_remove(&e->hash_elem);
+    twoq_remove(e, true);
+    buffer_stats.evictions++;
+  }
+  ASSERT(!e->dirty);
+  ASSERT(e->journal == JOURNAL_NONE && e->jseq == 0);
+  e->sector = sector;
+  e->is_deleted = false;
+  e->access = false;
+  list_push_front(buffer_bucket(sector), &e->hash_elem);
+  if(buffer_policy == BUFFER_2Q)
+    twoq_insert(e);
 }
 
-void
-buffer_write(disk_sector_t sector, void * data, int offset, int size)
+/* Writes dirty block E back to its sector.  E is held shared
+   during the transfer, so readers may still use it but writers
+   and eviction wait.  E counts as clean from the start, which
+   also keeps a second writeback of the same data from starting.
+   buffer_lock is released meanwhile. */
+static void
+buffer_writeback(struct buffcache_elem * e)
 {
-//  printf("buffer_write\n");
+  ASSERT(lock_held_by_current_thread(&buffer_lock));
+  ASSERT(e->dirty && !e->writer && !e->io_busy);
+
+  e->dirty = false;
+  e->jseq = 0;
+  dirty_cnt--;
+  buffer_stats.writebacks++;
+  e->readers++;
+  lock_release(&buffer_lock);
+  disk_write(filesys_disk, e->sector, e->data);
   lock_acquire(&buffer_lock);
-  int target_index = buffer_find(sector);
+  e->readers--;
+  if(e->readers == 0)
+  {
+    cond_broadcast(&e->cond, &buffer_lock);
+    cond_broadcast(&buffer_avail, &buffer_lock);
+  }
+}
+
+/* Returns the block caching SECTOR, loading it first on a miss,
+   held shared or, if EXCLUSIVE, exclusively.  Blocks until the
+   block is available in that mode.  Must be paired with
+   buffer_release().  If FILL is false, a miss does not read the
+   sector and leaves the block's data undefined, for a caller
+   that is about to overwrite all of it; this needs EXCLUSIVE.
+   The access is counted under class CLS. */
+static struct buffcache_elem *
+buffer_acquire(disk_sector_t sector, bool exclusive, bool fill, int cls)
+{
   struct buffcache_elem * e;
+  int target_index;
 
+  ASSERT(exclusive || fill);
 
-  if(target_index == NO_HIT)
+  lock_acquire(&buffer_lock);
+  while(true)
   {
-//    printf("in case of NO_HIT in buffer_write\n");
-    target_index = buffer_evict();
-    e = &buffer_cache[target_index];
-    disk_read(filesys_disk, sector, e->data);
+    target_index = buffer_find(sector);
+    if(target_index != NO_HIT) // cache hit
+    {
+      e = &buffer_cache[target_index];
+      if(e->io_busy || e->writer || (exclusive && e->readers > 0))
+      {
+        cond_wait(&e->cond, &buffer_lock);
+        continue;
+      }
+      if(cls != CLASS_READ_AHEAD)
+        buffer_stats.hits[cls]++;
+      if(buffer_policy == BUFFER_2Q)
+        twoq_touch(e);
+      break;
+    }
 
-    e->sector = sector;
-    e->is_deleted = false;
-    e->access = false;
-    e->dirty = false;
+    /* Blocks held for the journal only come free once a commit
+       has logged them, and the commit needs blocks of its own to
+       do so, so the last few are kept for it.  A thread in a
+       handle may take them all the same: journal_begin() made
+       room for the handle's blocks, and a commit would wait for
+       the handle to end, so it only ever waits out other threads'
+       pins. */
+    e = NULL;
+    if(buffer_size - journal_cnt > JOURNAL_RESERVE || journal_committing()
+       || thread_current()->journal_depth > 0)
+      e = buffer_alloc();
+    else if(buffer_grow())
+      continue;
+    if(e == NULL) // every block is held or being filled.
+    {
+      if(thread_current()->journal_depth == 0)
+        journal_wake();
+      cond_wait(&buffer_avail, &buffer_lock);
+      continue;
+    }
+    if(e->dirty)
+    {
+      /* Others may have loaded SECTOR or claimed E while we were
+         writing it back, so look again from scratch unless E is
+         still ours to take. */
+      buffer_writeback(e);
+      if(buffer_find(sector) != NO_HIT || !buffer_evictable(e) || e->dirty)
+        continue;
+    }
+
+    buffer_install(e, sector);
+    if(cls == CLASS_READ_AHEAD)
+      buffer_stats.read_aheads++;
+    else
+      buffer_stats.misses[cls]++;
+    if(!fill)
+    {
+      buffer_stats.fill_skips++;
+      break;
+    }
+    buffer_stats.read_fills++;
+    if(exclusive)
+      buffer_stats.write_fills++;
+    e->io_busy = true;
+    lock_release(&buffer_lock);
+    disk_read(filesys_disk, sector, e->data);
+    lock_acquire(&buffer_lock);
+    e->io_busy = false;
+    cond_broadcast(&e->cond, &buffer_lock);
+    break;
   }
-  else if(buffer_cache[target_index].is_deleted)
+
+  if(exclusive)
   {
-//    printf("in case of deleted in buffer_write\n");
-    e = &buffer_cache[target_index];
-    disk_read(filesys_disk, sector, e->data);
+    e->writer = true;
+    e->cls = cls;
+  }
+  else
+    e->readers++;
+  e->access = true;
+  lock_release(&buffer_lock);
+  return e;
+}
 
-    e->sector = sector;
-    e->is_deleted = false;
-    e->access = false;
-    e->dirty = false;
+/* Releases block E, acquired by buffer_acquire() in the same
+   mode, marking it dirty if DIRTY.  A metadata block marked dirty
+   is held for the journal to log.  File data can only be written
+   to a sector once the free that made it file data has committed,
+   along with a revocation of any copy in the log, so a logged
+   copy it may still have is forgotten. */
+static void
+buffer_release(struct buffcache_elem * e, bool exclusive, bool dirty)
+{
+  bool metadata = dirty && journal_is_metadata(e->cls);
+  bool wake = false;
+
+  lock_acquire(&buffer_lock);
+  if(dirty && !e->dirty)
+  {
+    e->dirty = true;
+    e->dirty_since = timer_ticks();
+    dirty_cnt++;
   }
+  if(dirty && !metadata && e->journal == JOURNAL_NONE)
+    e->jseq = 0;
+  if(metadata && e->journal == JOURNAL_NONE)
+  {
+    e->journal = JOURNAL_DIRTY;
+    journal_cnt++;
+    wake = journal_cnt * 100 > buffer_size * JOURNAL_HELD_PERCENT
+           || journal_cnt > JOURNAL_SECTORS / 2;
+  }
+  if(exclusive)
+    e->writer = false;
   else
+    e->readers--;
+  if(buffer_idle(e))
   {
-//    printf("cache hit\n");
-    e = &buffer_cache[target_index];
+    cond_broadcast(&e->cond, &buffer_lock);
+    cond_broadcast(&buffer_avail, &buffer_lock);
   }
+  lock_release(&buffer_lock);
+  if(wake)
+    journal_wake();
+}
 
-  e->dirty = true;
-  e->access = true;
+void
+buffer_read(disk_sector_t sector, void * data, int offset, int size,
+            enum fsstat_class cls)
+{
+  struct buffcache_elem * e = buffer_acquire(sector, false, true, cls);
+  memcpy(data, e->data + offset, size);
+  buffer_release(e, false, false);
+}
 
+void
+buffer_write(disk_sector_t sector, void * data, int offset, int size,
+             enum fsstat_class cls)
+{
+  bool whole = offset == 0 && size == DISK_SECTOR_SIZE;
+  struct buffcache_elem * e = buffer_acquire(sector, true, !whole, cls);
   memcpy(e->data + offset, data, size);
-  //struct inode_disk * k = (struct inode_disk *)data;
-  //printf("k->start is %d, k->length is %d\n", ((struct inode_disk *)data)->start,((struct inode_disk *)data)->length);
+  buffer_release(e, true, true);
+}
+
+/* Pins the block caching SECTOR, loading it on a miss, and
+   returns it so that the caller can work on its data in place
+   instead of copying it out.  The block is held exclusively if
+   EXCLUSIVE, shared otherwise.  Release it with buffer_put(),
+   without calling back into the cache for the same sector in
+   between.  The access is counted under class CLS. */
+struct buffcache_elem *
+buffer_get(disk_sector_t sector, bool exclusive, enum fsstat_class cls)
+{
+  return buffer_acquire(sector, exclusive, true, cls);
+}
+
+/* Releases block E obtained from buffer_get(), marking it dirty
+   if DIRTY.  Only an exclusive holder may pass DIRTY. */
+void
+buffer_put(struct buffcache_elem * e, bool dirty)
+{
+  bool exclusive = e->writer;
+
+  ASSERT(exclusive || !dirty);
+  buffer_release(e, exclusive, dirty);
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache.
+   Returns at once; the request is dropped if SECTOR is already
+   cached or the queue is full. */
+void
+buffer_read_ahead(disk_sector_t sector)
+{
+  bool cached;
+
+  lock_acquire(&buffer_lock);
+  cached = buffer_find(sector) != NO_HIT;
+  lock_release(&buffer_lock);
+  if(cached)
+    return;
+
+  lock_acquire(&read_ahead_lock);
+  if(ra_count < READ_AHEAD_QUEUE)
+  {
+    read_ahead_queue[(ra_head + ra_count) % READ_AHEAD_QUEUE] = sector;
+    ra_count++;
+    sema_up(&read_ahead_sema);
+  }
+  lock_release(&read_ahead_lock);
+}
+
+/* Fetches the sectors queued by buffer_read_ahead(), one at a
+   time, so the reader that queued them can keep copying out what
+   it already has. */
+static void
+read_ahead_daemon(void * aux UNUSED)
+{
+  disk_sector_t sector;
+
+  while(true)
+  {
+    sema_down(&read_ahead_sema);
+    lock_acquire(&read_ahead_lock);
+    sector = read_ahead_queue[ra_head];
+    ra_head = (ra_head + 1) % READ_AHEAD_QUEUE;
+    ra_count--;
+    lock_release(&read_ahead_lock);
+
+    buffer_release(buffer_acquire(sector, false, true, CLASS_READ_AHEAD), false, false);
+  }
+}
+
+/* Returns true if more than PERCENT percent of the cache is dirty. */
+static bool
+buffer_dirty_over(int percent)
+{
+  return dirty_cnt * 100 > buffer_size * percent;
+}
+
+/* qsort() comparison of two flush_list[] entries by sector. */
+static int
+flush_compare(const void * a_, const void * b_)
+{
+  const struct buffcache_elem * a = *(struct buffcache_elem * const *) a_;
+  const struct buffcache_elem * b = *(struct buffcache_elem * const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes the CNT blocks in flush_list[], which are in sector
+   order, merging runs of adjacent sectors into single transfers
+   of up to FLUSH_RUN_MAX sectors. */
+static void
+flush_write(int cnt)
+{
+  const void * run[FLUSH_RUN_MAX];
+  disk_sector_t start;
+  int i, n;
+
+  for(i=0; i<cnt; i+=n)
+  {
+    start = flush_list[i]->sector;
+    for(n=0; i+n<cnt && n<FLUSH_RUN_MAX; n++)
+    {
+      if(flush_list[i+n]->sector != start + n)
+        break;
+      run[n] = flush_list[i+n]->data;
+    }
+    if(n == 1)
+      disk_write(filesys_disk, start, run[0]);
+    else
+      disk_write_multiple(filesys_disk, start, n, run);
+  }
+}
 
+/* Writes dirty blocks back in one sweep across the disk: the
+   chosen blocks are marked clean and held shared, then written in
+   sector order with adjacent sectors merged, then released.  If
+   ALL, every dirty block is written, waiting for blocks held
+   exclusively, which may be about to become dirty.  Otherwise
+   only blocks that have aged past WRITE_BEHIND_AGE are written,
+   or any block while the cache is more than WRITE_BEHIND_HIGH
+   percent dirty, and held blocks are left alone.  If DATA_ONLY,
+   blocks that the journal would log are left alone too. */
+static void
+buffer_flush(bool all, bool data_only)
+{
+  struct buffcache_elem * e;
+  struct buffcache_elem * busy;
+  bool draining;
+  int cnt, i;
 
-  e = &buffer_cache[target_index];
-  //struct inode_disk * a = (struct inode_disk *) &e->data;
-  //printf("a->start is %d, a->length is %d\n", a->start, a->length);
+  lock_acquire(&flush_lock);
+  lock_acquire(&buffer_lock);
+  draining = !all && buffer_dirty_over(WRITE_BEHIND_HIGH);
+  do
+  {
+    /* Blocks pinned in flush_list[] are never waited on with others
+       pinned, since their holders might be waiting for ours. */
+    busy = NULL;
+    cnt = 0;
+    for(i=0; i<buffer_size; i++)
+    {
+      e = &buffer_cache[i];
+      if(e->is_deleted || e->journal != JOURNAL_NONE)
+        continue;
+      if(e->writer || e->io_busy)
+      {
+        if(all && e->writer)
+          busy = e;
+        continue;
+      }
+      if(!e->dirty || (data_only && journal_is_metadata(e->cls)))
+        continue;
+      if(draining && !buffer_dirty_over(WRITE_BEHIND_LOW))
+        draining = false;
+      if(!all && !draining && timer_elapsed(e->dirty_since) < WRITE_BEHIND_AGE)
+        continue;
+
+      e->dirty = false;
+      e->jseq = 0;
+      dirty_cnt--;
+      buffer_stats.writebacks++;
+      e->readers++;
+      flush_list[cnt++] = e;
+    }
+    lock_release(&buffer_lock);
 
+    qsort(flush_list, cnt, sizeof *flush_list, flush_compare);
+    flush_write(cnt);
+
+    lock_acquire(&buffer_lock);
+    for(i=0; i<cnt; i++)
+    {
+      e = flush_list[i];
+      e->readers--;
+      if(buffer_idle(e))
+      {
+        cond_broadcast(&e->cond, &buffer_lock);
+        cond_broadcast(&buffer_avail, &buffer_lock);
+      }
+    }
+    if(busy != NULL)
+      while(busy->writer)
+        cond_wait(&busy->cond, &buffer_lock);
+  } while(busy != NULL);
   lock_release(&buffer_lock);
+  lock_release(&flush_lock);
 }
 
+/* Writes every dirty block back to disk. */
 void
 buffer_flush_all()
+{
+  buffer_flush(true, false);
+}
+
+/* Writes every dirty block of file data back to disk, for
+   filesys_crash(). */
+void
+buffer_flush_data(void)
+{
+  buffer_flush(true, true);
+}
+
+/* Returns the number of blocks held for the journal, those being
+   logged included. */
+int
+buffer_journal_held(void)
+{
+  int cnt;
+
+  lock_acquire(&buffer_lock);
+  cnt = journal_cnt;
+  lock_release(&buffer_lock);
+  return cnt;
+}
+
+/* Returns true if the journal holds SECTOR's block, to be logged
+   or being logged. */
+bool
+buffer_journal_holds(disk_sector_t sector)
 {
   int i;
-  struct buffcache_elem * e;
+  bool held;
+
+  lock_acquire(&buffer_lock);
+  i = buffer_find(sector);
+  held = i != NO_HIT && buffer_cache[i].journal != JOURNAL_NONE;
+  lock_release(&buffer_lock);
+  return held;
+}
+
+/* Returns how many blocks the journal may hold at once, having
+   grown the cache first if that is fewer than WANT and the kernel
+   pool allows.  Besides those, the cache keeps JOURNAL_RESERVE
+   slots for the commit and a page's worth for the blocks that
+   threads have pinned, and it never shrinks back below what it
+   has promised. */
+int
+buffer_journal_room(int want)
+{
+  int room;
+
   lock_acquire(&buffer_lock);
+  while(buffer_size - JOURNAL_RESERVE - CACHE_PAGE_SECTORS < want
+        && buffer_grow())
+    continue;
+  room = buffer_size - JOURNAL_RESERVE - CACHE_PAGE_SECTORS;
+  if(journal_room < room)
+    journal_room = room;
+  lock_release(&buffer_lock);
+  return room;
+}
+
+/* Takes up to MAX blocks held for the journal into BLOCKS for a
+   commit to log, and returns how many it took.  Blocks
+   held exclusively are left for the next commit.  The blocks taken
+   stay held shared, so they can be read but not changed, until
+   buffer_journal_done(). */
+int
+buffer_journal_take(struct buffcache_elem ** blocks, int max)
+{
+  struct buffcache_elem * e;
+  int cnt = 0;
+  int i;
 
-  for(i=0; i<CACHE_SIZE; i++)
+  lock_acquire(&buffer_lock);
+  for(i=0; i<buffer_size && cnt<max; i++)
   {
     e = &buffer_cache[i];
-    if(e->dirty)
-      disk_write(filesys_disk, e->sector, e->data);
+    if(e->writer || e->journal != JOURNAL_DIRTY)
+      continue;
+    ASSERT(!e->io_busy && !e->is_deleted);
+    e->journal = JOURNAL_LOGGING;
+    e->readers++;
+    blocks[cnt++] = e;
   }
   lock_release(&buffer_lock);
+  return cnt;
 }
 
-int buffer_evict()
+/* Gives back the CNT BLOCKS taken by buffer_journal_take() once
+   transaction SEQ has committed them, the I'th one logged at log
+   sector POS[I].  They become ordinary dirty blocks. */
+void
+buffer_journal_done(struct buffcache_elem ** blocks, int cnt, uint32_t seq,
+                    const disk_sector_t * pos)
 {
-  int i;
   struct buffcache_elem * e;
-  int result = -1;
-  
-  //printf("buffer_evict called ");
+  int i;
 
-  while(true)
+  lock_acquire(&buffer_lock);
+  for(i=0; i<cnt; i++)
   {
-    e = &buffer_cache[hand];
-    if(e->access)
+    e = blocks[i];
+    e->jseq = seq;
+    e->jpos = pos[i];
+    e->journal = JOURNAL_NONE;
+    journal_cnt--;
+    e->readers--;
+    if(buffer_idle(e))
     {
-      e->access = false;
-      hand = (hand+1)%CACHE_SIZE;
-    }
-    else // do evict
-    {
-      //printf("evicted sector is %d\n", e->sector);
-      if(e->dirty)
-      {
-        disk_write(filesys_disk, e->sector, e->data);
-      }
-      //disk_write(filesys_disk, e->sector, e->data);
-      result = hand;
-      hand = (hand+1)%CACHE_SIZE;
-      break;
+      cond_broadcast(&e->cond, &buffer_lock);
+      cond_broadcast(&buffer_avail, &buffer_lock);
     }
   }
+  lock_release(&buffer_lock);
+}
 
-//  printf("buffer_evict end\n");
+/* Returns the oldest transaction that logged a block not yet
+   written in place, or 0 if there is none. */
+uint32_t
+buffer_journal_oldest(void)
+{
+  uint32_t oldest = 0;
+  int i;
 
-  return result;
+  lock_acquire(&buffer_lock);
+  for(i=0; i<buffer_size; i++)
+    if(buffer_cache[i].jseq != 0
+       && (oldest == 0 || buffer_cache[i].jseq < oldest))
+      oldest = buffer_cache[i].jseq;
+  lock_release(&buffer_lock);
+  return oldest;
 }
 
+/* Writes every committed block in place, so that the whole log
+   can be reused.  A block that nobody holds and that has not
+   changed since is written back as usual; otherwise, since it
+   may have changed or be held by a thread that a commit must not
+   wait on, its committed copy is copied over from the log.  Only
+   the thread committing may call this. */
+void
+buffer_journal_checkpoint(void)
+{
+  struct buffcache_elem * e;
+  char * buf;
+  disk_sector_t sector, pos;
+  uint32_t seq;
+  int i;
 
+  buf = malloc(DISK_SECTOR_SIZE);
+  if(buf == NULL)
+    PANIC("buffer_journal_checkpoint: out of memory");
+  lock_acquire(&buffer_lock);
+  for(i=0; i<buffer_size; i++)
+  {
+    e = &buffer_cache[i];
+    if(e->jseq == 0)
+      continue;
+    if(e->journal == JOURNAL_NONE && e->dirty && !e->writer && !e->io_busy)
+    {
+      buffer_writeback(e);
+      continue;
+    }
 
+    /* Only commits set JSEQ, so it stays put meanwhile unless a
+       writeback clears it. */
+    sector = e->sector;
+    pos = e->jpos;
+    seq = e->jseq;
+    lock_release(&buffer_lock);
+    disk_read(filesys_disk, pos, buf);
+    disk_write(filesys_disk, sector, buf);
+    lock_acquire(&buffer_lock);
+    if(e->jseq == seq)
+      e->jseq = 0;
+  }
+  lock_release(&buffer_lock);
+  free(buf);
+}
 
+/* Adds a page worth of empty slots to the end of the cache.
+   Returns false if the cache is at buffer_capacity or the kernel
+   pool is out of pages. */
+static bool
+buffer_grow(void)
+{
+  struct buffcache_elem * e;
+  char * page;
+  int i;
 
+  ASSERT(lock_held_by_current_thread(&buffer_lock));
 
+  if(buffer_size >= buffer_capacity)
+    return false;
+  page = palloc_get_page(0);
+  if(page == NULL)
+    return false;
 
+  for(i=0; i<CACHE_PAGE_SECTORS; i++)
+  {
+    e = &buffer_cache[buffer_size + i];
+    e->data = page + i * DISK_SECTOR_SIZE;
+    e->is_deleted = true;
+    e->access = false;
+    e->dirty = false;
+    e->sector = -1;
+    list_push_back(&buffer_free_list, &e->free_elem);
+  }
+  buffer_size += CACHE_PAGE_SECTORS;
+  cond_broadcast(&buffer_avail, &buffer_lock);
+  return true;
+}
 
+/* Gives the page behind the last CACHE_PAGE_SECTORS slots back to
+   the kernel pool, forgetting whatever they cache.  Does nothing
+   if the cache is at its initial size, or at the size it has
+   promised the journal, or if one of those slots is in use.
+   Dirty slots among them are written back instead, to be dropped
+   on a later call.  Returns true if the page was
+   freed. */
+static bool
+buffer_shrink(void)
+{
+  struct buffcache_elem * e;
+  bool dirty = false;
+  int base = buffer_size - CACHE_PAGE_SECTORS;
+  int i;
 
+  ASSERT(lock_held_by_current_thread(&buffer_lock));
 
+  if(buffer_size <= buffer_init_size
+     || base < journal_room + JOURNAL_RESERVE + CACHE_PAGE_SECTORS)
+    return false;
+  for(i=base; i<buffer_size; i++)
+    if(!buffer_evictable(&buffer_cache[i]))
+      return false;
+  for(i=base; i<buffer_size; i++)
+  {
+    e = &buffer_cache[i];
+    if(e->dirty && buffer_evictable(e))
+    {
+      buffer_writeback(e);
+      dirty = true;
+    }
+  }
+  if(dirty)
+    return false;
 
+  for(i=base; i<buffer_size; i++)
+  {
+    e = &buffer_cache[i];
+    if(e->is_deleted)
+      list_remove(&e->free_elem);
+    else
+    {
+      list_remove(&e->hash_elem);
+      twoq_remove(e, false);
+    }
+    e->is_deleted = true;
+  }
+  palloc_free_page(buffer_cache[base].data);
+  for(i=base; i<buffer_size; i++)
+    buffer_cache[i].data = NULL;
+  buffer_size = base;
+  if(hand >= buffer_size)
+    hand = 0;
+  return true;
+}
 
+/* Sizes the cache to the memory left in the kernel pool: a page
+   back when the pool runs low, or up to CACHE_GROW_STEP more
+   pages when every slot already holds a sector and the pool has
+   plenty. */
+static void
+buffer_resize(void)
+{
+  size_t free_pages = palloc_free_cnt(0);
+  int i;
 
+  if(free_pages < CACHE_SHRINK_FREE)
+    buffer_shrink();
+  else if(list_empty(&buffer_free_list))
+    for(i=0; i<CACHE_GROW_STEP && palloc_free_cnt(0) > CACHE_GROW_FREE; i++)
+      if(!buffer_grow())
+        break;
+}
 
+/* Writes back dirty blocks in the background so that eviction
+   mostly finds clean victims and a crash loses at most about
+   WRITE_BEHIND_AGE ticks of writes.  Wakes every WRITE_BEHIND_NAP
+   ticks; on each pass writes the blocks that have aged, or every
+   dirty block it can get at while too much of the cache is dirty,
+   through buffer_flush(), after handing it the free map's changes.  Each pass ends by resizing the cache to the free memory. */
+static void
+write_behind_daemon(void * aux UNUSED)
+{
+  while(true)
+  {
+    timer_sleep(WRITE_BEHIND_NAP);
+    /* Under the journal, the free map's changes go to disk with
+       each commit instead, and a block for them could only be had
+       from the few kept for the commit. */
+    if(!journal_is_metadata(FSSTAT_FREEMAP))
+      free_map_flush();
+    buffer_flush(false, buffer_hold_metadata);
 
+    lock_acquire(&buffer_lock);
+    buffer_resize();
+    lock_release(&buffer_lock);
+  }
+}
 
+/* Runs the clock over the slots in use and returns the index of a
+   block that nobody holds, or -1 if every block is in use. */
+static int
+buffer_evict_clock(void)
+{
+  struct buffcache_elem * e;
+  int result = -1;
+  int i;
 
+  for(i=0; i<2*buffer_size; i++)
+  {
+    e = &buffer_cache[hand];
+    hand = (hand+1)%buffer_size;
+    if(!buffer_evictable(e))
+      continue;
+    if(e->access)
+      e->access = false;
+    else // do evict
+    {
+      result = e - buffer_cache;
+      break;
+    }
+  }
+  return result;
+}
+
+/* Returns the idle block nearest the back of queue Q, or a null
+   pointer if every block on it is in use. */
+static struct buffcache_elem *
+twoq_victim(struct list * q)
+{
+  struct list_elem * le;
+  struct buffcache_elem * e;
+
+  for(le = list_rbegin(q); le != list_rend(q); le = list_prev(le))
+  {
+    e = list_entry(le, struct buffcache_elem, queue_elem);
+    if(buffer_evictable(e))
+      return e;
+  }
+  return NULL;
+}
+
+/* 2Q (Johnson and Shasha).  A loaded block goes on A1in and leaves
+   it in FIFO order however often it is hit there, so a long scan
+   only cycles through A1in and leaves the blocks on Am alone.
+   A sector that misses again while its ghost is still on A1out
+   is evidently reused and goes to Am, kept in LRU order.  Victims
+   come from A1in while it holds more than TWOQ_IN_PERCENT of the
+   cache, from Am otherwise.  Returns the victim's index, or -1 if
+   every block is in use. */
+static int
+buffer_evict_2q(void)
+{
+  struct buffcache_elem * e = NULL;
+
+  if(twoq_in_cnt * 100 > buffer_size * TWOQ_IN_PERCENT)
+    e = twoq_victim(&twoq_in);
+  if(e == NULL)
+    e = twoq_victim(&twoq_main);
+  if(e == NULL)
+    e = twoq_victim(&twoq_in);
+  return e == NULL ? -1 : e - buffer_cache;
+}
 
+/* Picks a block to reuse under the current policy and returns its
+   index, or -1 if every block is in use.  A dirty victim is not
+   written back here; the caller does that without holding
+   buffer_lock. */
+int buffer_evict()
+{
+  ASSERT(lock_held_by_current_thread(&buffer_lock));
 
+  if(buffer_policy == BUFFER_2Q)
+    return buffer_evict_2q();
+  return buffer_evict_clock();
+}
 
+/* Selects the replacement policy named NAME, "clock" or "2q".
+   Must be called before buffer_init().  Returns false if NAME is
+   not a policy. */
+bool
+buffer_set_policy(const char * name)
+{
+  if(name == NULL)
+    return false;
+  if(!strcmp(name, "clock"))
+    buffer_policy = BUFFER_CLOCK;
+  else if(!strcmp(name, "2q"))
+    buffer_policy = BUFFER_2Q;
+  else
+    return false;
+  return true;
+}
 
+/* Copies the buffer cache statistics into the matching fields
+   of ST, leaving the others alone. */
+void
+buffer_get_stats(struct fsstat * st)
+{
+  int i;
 
+  lock_acquire(&buffer_lock);
+  for(i=0; i<FSSTAT_CLASS_CNT; i++)
+  {
+    st->hits[i] = buffer_stats.hits[i];
+    st->misses[i] = buffer_stats.misses[i];
+  }
+  st->read_fills = buffer_stats.read_fills;
+  st->write_fills = buffer_stats.write_fills;
+  st->fill_skips = buffer_stats.fill_skips;
+  st->read_aheads = buffer_stats.read_aheads;
+  st->evictions = buffer_stats.evictions;
+  st->writebacks = buffer_stats.writebacks;
+  st->cache_sectors = buffer_size;
+  lock_release(&buffer_lock);
+}
 
+/* Prints buffer cache statistics. */
+void
+buffer_print_stats(void)
+{
+  static const char * class_names[FSSTAT_CLASS_CNT] =
+    {"inode", "indirect", "dir", "freemap", "data"};
+  struct fsstat st;
+  long long hits = 0, misses = 0;
+  int i;
 
+  buffer_get_stats(&st);
+  for(i=0; i<FSSTAT_CLASS_CNT; i++)
+  {
+    hits += st.hits[i];
+    misses += st.misses[i];
+  }
+  printf("Buffer cache: %d sectors (%s), %lld hits, %lld misses\n",
+         st.cache_sectors, buffer_policy == BUFFER_2Q ? "2q" : "clock",
+         hits, misses);
+  printf("Buffer cache: %lld reads (%lld for partial writes), "
+         "%lld full-sector writes not read, %lld read-aheads\n",
+         st.read_fills, st.write_fills, st.fill_skips, st.read_aheads);
+  printf("Buffer cache: %lld evictions, %lld writebacks\n",
+         st.evictions, st.writebacks);
+  for(i=0; i<FSSTAT_CLASS_CNT; i++)
+    printf("Buffer cache: %s: %lld hits, %lld misses\n",
+           class_names[i], st.hits[i], st.misses[i]);
+}
@@ -1,34 +1,135 @@
-#ifndef FILESYS_FILE_H
-#define FILESYS_FILE_H
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
 
 #include <stdbool.h>
+#include <fsstat.h>
+#include <list.h>
 #include "devices/disk.h"
+#include "devices/timer.h"
 #include "filesys/off_t.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 #include "filesys/filesys.h"
 
+/* Cache size, in sectors.  The cache starts at buffer_init_size
+   sectors (CACHE_SIZE unless set with -cache=SECTORS) and then
+   grows, a page of sectors at a time, while the kernel pool has
+   more than CACHE_GROW_FREE pages free and every slot is in use,
+   up to CACHE_MAX_SIZE.  It gives pages back, down to its initial
+   size, while fewer than CACHE_SHRINK_FREE are free. */
 #define CACHE_SIZE 64
+#define CACHE_MAX_SIZE 1024
+#define CACHE_PAGE_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
+#define CACHE_GROW_FREE 64
+#define CACHE_SHRINK_FREE 16
+#define CACHE_GROW_STEP 4       /* Max pages added per write-behind pass. */
 #define NO_HIT (-2)
 
+/* Replacement policies, chosen at boot with -cache-policy=. */
+enum buffer_policy
+{
+  BUFFER_CLOCK,                 /* One-bit clock over the access flags. */
+  BUFFER_2Q                     /* 2Q, see buffer_evict_2q(). */
+};
+
+/* 2Q queue sizes, as percentages of the cache size. */
+#define TWOQ_IN_PERCENT 25      /* Resident blocks seen only once. */
+#define TWOQ_OUT_PERCENT 50     /* Ghosts of blocks evicted from A1in. */
+
+/* Which 2Q queue a block is on. */
+enum buffer_queue
+{
+  QUEUE_NONE,
+  QUEUE_IN,                     /* A1in, FIFO. */
+  QUEUE_MAIN                    /* Am, LRU. */
+};
+#define CACHE_HASH_LOAD 4       /* Slots per buffer_hash bucket. */
+#define READ_AHEAD_QUEUE 64     /* Max sectors waiting to be prefetched. */
+
+/* Write-behind.  Dirty blocks older than WRITE_BEHIND_AGE ticks are
+   written back; once more than WRITE_BEHIND_HIGH percent of the
+   cache is dirty, blocks are written regardless of age until the
+   dirty share drops to WRITE_BEHIND_LOW percent. */
+#define WRITE_BEHIND_NAP (TIMER_FREQ / 10)
+#define WRITE_BEHIND_AGE (TIMER_FREQ * 3)
+#define WRITE_BEHIND_HIGH 50
+#define WRITE_BEHIND_LOW 25
+
+/* Most adjacent sectors that a flush writes with one disk command. */
+#define FLUSH_RUN_MAX 32
+
+/* Where a block stands with the journal.  A block in any state
+   but JOURNAL_NONE is neither written back nor evicted. */
+enum journal_state
+{
+  JOURNAL_NONE,
+  JOURNAL_DIRTY,                /* Metadata changed, to be logged. */
+  JOURNAL_LOGGING               /* Being logged by a commit. */
+};
+
 struct buffcache_elem
 {
   disk_sector_t sector;
-  char data[DISK_SECTOR_SIZE];
+  char * data;                  /* DISK_SECTOR_SIZE bytes in a palloc page. */
   bool is_deleted;
   bool access;
   bool dirty;
+  int64_t dirty_since;          /* Tick at which the block became dirty. */
+  struct list_elem hash_elem;   /* Element in a buffer_hash bucket. */
+  struct list_elem free_elem;   /* Element in buffer_free_list. */
+  struct list_elem queue_elem;  /* Element in a 2Q queue. */
+  enum buffer_queue queue;
+  enum fsstat_class cls;        /* Class of the last exclusive access. */
+
+  /* Journal.  A committed change not yet written in place is
+     logged at JPOS by transaction JSEQ; JSEQ is 0 if there is none.
+     These fields are protected by buffer_lock. */
+  enum journal_state journal;
+  uint32_t jseq;
+  disk_sector_t jpos;
+
+  /* Per-block locking.  These fields are protected by buffer_lock,
+     which is never held across disk I/O or a copy to or from the
+     block; the block's own state keeps others out instead. */
+  int readers;                  /* Threads holding the block shared. */
+  bool writer;                  /* Held exclusively by one thread? */
+  bool io_busy;                 /* Being filled from disk. */
+  struct condition cond;        /* Signaled when the block is released. */
 };
 
-struct buffcache_elem buffer_cache[CACHE_SIZE];
+/* buffer_capacity slots, of which the first buffer_size have data
+   pages.  Both are multiples of CACHE_PAGE_SECTORS. */
+struct buffcache_elem * buffer_cache;
+int buffer_size;
+int buffer_capacity;
 struct lock buffer_lock;
 int hand;
 
+extern int buffer_init_size;
+extern enum buffer_policy buffer_policy;
+extern bool buffer_hold_metadata;
+
 void buffer_init(void);
 void buffer_done(void);
 int buffer_find(disk_sector_t);
-void buffer_read(disk_sector_t, void *, int, int);
-void buffer_write(disk_sector_t, void *, int, int);
+void buffer_read(disk_sector_t, void *, int, int, enum fsstat_class);
+void buffer_write(disk_sector_t, void *, int, int, enum fsstat_class);
+void buffer_read_ahead(disk_sector_t);
+struct buffcache_elem * buffer_get(disk_sector_t, bool, enum fsstat_class);
+void buffer_put(struct buffcache_elem *, bool);
 void buffer_flush_all(void);
+void buffer_flush_data(void);
+int buffer_journal_held(void);
+bool buffer_journal_holds(disk_sector_t);
+int buffer_journal_room(int);
+int buffer_journal_take(struct buffcache_elem **, int);
+void buffer_journal_done(struct buffcache_elem **, int, uint32_t,
+                         const disk_sector_t *);
+uint32_t buffer_journal_oldest(void);
+void buffer_journal_checkpoint(void);
 int buffer_evict(void);
+bool buffer_set_policy(const char *);
+void buffer_get_stats(struct fsstat *);
+void buffer_print_stats(void);
 
 #endif
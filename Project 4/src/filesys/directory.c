@@ -2,9 +2,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 
 
@@ -24,6 +27,375 @@ struct dir_entry
 //    disk_sector_t parent;
   };
 
+/* Indexed directories.
+
+   A directory starts out as a plain array of entries, searched
+   from one end to the other.  Once it outgrows the space inside
+   its inode (INODE_INLINE_MAX bytes), it is rebuilt as a hash
+   table.  Block 0 of the file is then a struct dir_index, which
+   names the bucket block for each value of the low
+   DIR_INDEX_BITS bits of a name's hash, and the blocks after it
+   are struct dir_bucket.  A full bucket splits in two, as in
+   extendible hashing, until it serves a single slot; after that
+   it chains overflow blocks.  New blocks go at the end.  Lookup,
+   add and remove read the header and one bucket, barring
+   overflow. */
+#define DIR_INDEX_BITS 7
+#define DIR_INDEX_SLOTS (1 << DIR_INDEX_BITS)
+
+/* Identifies an indexed directory.  A linear directory's first
+   word is an inode sector, which is never this large. */
+#define DIR_INDEX_MAGIC 0x58444e49
+
+/* Header of an indexed directory, in block 0.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct dir_index
+  {
+    uint32_t magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t blocks;                    /* Blocks in use, this one included. */
+    uint16_t slots[DIR_INDEX_SLOTS];    /* Bucket block for each hash value. */
+    uint8_t unused[DISK_SECTOR_SIZE - 8 - 2 * DIR_INDEX_SLOTS];
+  };
+
+/* Entries in a bucket. */
+#define DIR_BUCKET_ENTRIES 25
+
+/* Bucket block of an indexed directory.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    uint32_t depth;                     /* Hash bits its names share. */
+    uint32_t next;                      /* Overflow block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct dir_entry entries[DIR_BUCKET_ENTRIES];
+  };
+
+/* Where dir_add() should start looking for a free entry in a
+   directory, kept in memory with its inode by inode_dir_hint() so
+   that filling a directory does not read its full entries again
+   and again.  All-zero bits mean "from the start". */
+struct dir_hint
+  {
+    /* Linear directory: no free entry lies before this offset. */
+    off_t free_ofs;
+
+    /* Indexed directory: for each hash slot, the first block of
+       its bucket's chain that may have a free entry, or 0 if not
+       known.  A chain's blocks follow one another in increasing
+       order, because new blocks go at the end. */
+    uint16_t chain_free[DIR_INDEX_SLOTS];
+  };
+
+/* Returns DIR's hint, or a null pointer if memory runs out.  The
+   caller must hold DIR's lock. */
+static struct dir_hint *
+dir_hint (const struct dir *dir)
+{
+  return inode_dir_hint (dir->inode, sizeof (struct dir_hint));
+}
+
+/* Returns the hash of NAME, by the 32-bit FNV-1a function. */
+static uint32_t
+name_hash (const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; *name != '\0'; name++)
+    hash = (hash ^ (uint8_t) *name) * 16777619u;
+  return hash;
+}
+
+/* Returns the number of blocks in use in DIR if it is indexed,
+   or 0 if it is linear. */
+static size_t
+index_blocks (const struct dir *dir)
+{
+  struct buffcache_elem *b;
+  const struct dir_index *index;
+  size_t blocks = 0;
+
+  ASSERT (sizeof *index == DISK_SECTOR_SIZE);
+  ASSERT (sizeof (struct dir_bucket) == DISK_SECTOR_SIZE);
+
+  b = inode_get_block (dir->inode, 0, false);
+  if (b == NULL)
+    return 0;
+  index = (const struct dir_index *) b->data;
+  if (index->magic == DIR_INDEX_MAGIC)
+    blocks = index->blocks;
+  buffer_put (b, false);
+  return blocks;
+}
+
+/* Returns the offset of the first entry at or after OFS in DIR,
+   which has BLOCKS blocks in use if it is indexed, or is linear
+   if BLOCKS is 0. */
+static off_t
+next_slot (size_t blocks, off_t ofs)
+{
+  off_t first = offsetof (struct dir_bucket, entries);
+  off_t in;
+
+  if (blocks == 0)
+    return ofs;
+  if (ofs < DISK_SECTOR_SIZE)
+    ofs = DISK_SECTOR_SIZE;
+  in = ofs % DISK_SECTOR_SIZE;
+  ofs -= in;
+  if (in <= first)
+    in = first;
+  else
+    in = first + ROUND_UP (in - first, sizeof (struct dir_entry));
+  if (in + sizeof (struct dir_entry) > DISK_SECTOR_SIZE)
+    return ofs + DISK_SECTOR_SIZE + first;
+  return ofs + in;
+}
+
+/* Returns the end of DIR's entries: the end of its last block in
+   use if it has BLOCKS, otherwise its length. */
+static off_t
+dir_end (const struct dir *dir, size_t blocks)
+{
+  return blocks > 0 ? (off_t) blocks * DISK_SECTOR_SIZE
+                    : inode_length (dir->inode);
+}
+
+/* Walks the entries of a directory, reading them in place out of
+   the buffer cache instead of copying each one out. */
+struct dir_cursor
+  {
+    struct buffcache_elem *block;       /* Pinned block, or null. */
+    off_t block_ofs;                    /* Directory offset of BLOCK. */
+    struct dir_entry bounce;            /* Entry split across sectors. */
+  };
+
+static void
+cursor_init (struct dir_cursor *c)
+{
+  c->block = NULL;
+}
+
+/* Releases the block C has pinned, if any.  Must be called before
+   writing to the directory and when done with C. */
+static void
+cursor_done (struct dir_cursor *c)
+{
+  if (c->block != NULL)
+    {
+      buffer_put (c->block, false);
+      c->block = NULL;
+    }
+}
+
+/* Returns the entry at OFS in DIR, or a null pointer at end of
+   directory.  The entry stays valid until the next call on C.
+   An entry that straddles two sectors, or that has no cache block
+   to point into because DIR is held inline in its inode, is
+   copied into C's bounce buffer; all others point into the
+   pinned cache block. */
+static const struct dir_entry *
+cursor_get (const struct dir *dir, struct dir_cursor *c, off_t ofs)
+{
+  int sector_ofs = ofs % DISK_SECTOR_SIZE;
+
+  if (ofs + (off_t) sizeof c->bounce > inode_length (dir->inode))
+    return NULL;
+
+  if (sector_ofs + sizeof c->bounce <= DISK_SECTOR_SIZE)
+    {
+      if (c->block == NULL || c->block_ofs != ofs - sector_ofs)
+        {
+          cursor_done (c);
+          c->block_ofs = ofs - sector_ofs;
+          c->block = inode_get_block (dir->inode, c->block_ofs, false);
+        }
+      if (c->block != NULL)
+        return (const struct dir_entry *) (c->block->data + sector_ofs);
+    }
+
+  cursor_done (c);
+  if (inode_read_at (dir->inode, &c->bounce, sizeof c->bounce, ofs)
+      != sizeof c->bounce)
+    return NULL;
+  return &c->bounce;
+}
+
+/* Directory entry cache.
+
+   Remembers the result of looking up a name in a directory, keyed
+   by the sector of the directory's inode and the name, so that
+   resolving the same path again needs no directory reads.  A name
+   that was not found is remembered too, with DENTRY_NEGATIVE in
+   place of a sector.  dir_add() and dir_remove() keep the entries
+   for the names they change up to date, and reusing a sector for
+   a new directory drops the entries left over from the old one.
+   At most DENTRY_MAX entries are kept; the least recently used
+   goes first. */
+#define DENTRY_HASH_SIZE 64             /* Buckets in dentry_table. */
+#define DENTRY_MAX 256                  /* Entries kept. */
+#define DENTRY_NEGATIVE ((disk_sector_t) -1)
+
+struct dentry
+  {
+    struct list_elem elem;              /* Element in a dentry_table bucket. */
+    struct list_elem lru_elem;          /* Element in dentry_lru. */
+    disk_sector_t parent;               /* Sector of the directory. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    disk_sector_t sector;               /* Sector of NAME, or DENTRY_NEGATIVE. */
+  };
+
+static struct list dentry_table[DENTRY_HASH_SIZE];
+static struct list dentry_lru;          /* Most recently used at the front. */
+static int dentry_cnt;
+static struct lock dentry_lock;         /* Guards all of the above. */
+static struct fsstat dentry_stats;      /* Guarded by dentry_lock. */
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  int i;
+
+  for (i = 0; i < DENTRY_HASH_SIZE; i++)
+    list_init (&dentry_table[i]);
+  list_init (&dentry_lru);
+  dentry_cnt = 0;
+  lock_init (&dentry_lock);
+}
+
+/* Returns the cache entry for NAME in the directory at PARENT, or
+   a null pointer.  The caller must hold dentry_lock. */
+static struct dentry *
+dentry_find (disk_sector_t parent, const char *name)
+{
+  struct list *bucket;
+  struct list_elem *e;
+
+  bucket = &dentry_table[(name_hash (name) ^ parent) % DENTRY_HASH_SIZE];
+  for (e = list_begin (bucket); e != list_end (bucket); e = list_next (e))
+    {
+      struct dentry *d = list_entry (e, struct dentry, elem);
+      if (d->parent == parent && !strcmp (d->name, name))
+        return d;
+    }
+  return NULL;
+}
+
+/* Removes D from the cache and frees it.  The caller must hold
+   dentry_lock. */
+static void
+dentry_free (struct dentry *d)
+{
+  list_remove (&d->elem);
+  list_remove (&d->lru_elem);
+  dentry_cnt--;
+  free (d);
+}
+
+/* Looks up NAME in the directory at PARENT in the cache.  If it is
+   there, stores its sector, or DENTRY_NEGATIVE if it is known not
+   to exist, in *SECTOR and returns true. */
+static bool
+dentry_get (disk_sector_t parent, const char *name, disk_sector_t *sector)
+{
+  struct dentry *d;
+
+  lock_acquire (&dentry_lock);
+  d = dentry_find (parent, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&dentry_lru, &d->lru_elem);
+      *sector = d->sector;
+      dentry_stats.dentry_hits++;
+      if (d->sector == DENTRY_NEGATIVE)
+        dentry_stats.dentry_negative_hits++;
+    }
+  else
+    dentry_stats.dentry_misses++;
+  lock_release (&dentry_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory at PARENT is at SECTOR, or
+   does not exist if SECTOR is DENTRY_NEGATIVE.  The caller must
+   hold the directory's lock, so that what it records is still
+   true.  Names too long to be in any directory are not recorded. */
+static void
+dentry_put (disk_sector_t parent, const char *name, disk_sector_t sector)
+{
+  struct dentry *d, *old = NULL;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dentry_lock);
+  d = dentry_find (parent, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        {
+          lock_release (&dentry_lock);
+          return;
+        }
+      d->parent = parent;
+      strlcpy (d->name, name, sizeof d->name);
+      list_push_front (&dentry_table[(name_hash (name) ^ parent)
+                                     % DENTRY_HASH_SIZE], &d->elem);
+      if (++dentry_cnt > DENTRY_MAX)
+        old = list_entry (list_back (&dentry_lru), struct dentry, lru_elem);
+    }
+  d->sector = sector;
+  list_push_front (&dentry_lru, &d->lru_elem);
+  if (old != NULL)
+    dentry_free (old);
+  lock_release (&dentry_lock);
+}
+
+/* Drops every cache entry for names in the directory at PARENT. */
+static void
+dentry_purge (disk_sector_t parent)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dentry_lock);
+  for (e = list_begin (&dentry_lru); e != list_end (&dentry_lru); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->parent == parent)
+        dentry_free (d);
+    }
+  lock_release (&dentry_lock);
+}
+
+/* Copies the directory entry cache statistics into the matching
+   fields of ST, leaving the others alone. */
+void
+dir_get_stats (struct fsstat *st)
+{
+  lock_acquire (&dentry_lock);
+  st->dentry_hits = dentry_stats.dentry_hits;
+  st->dentry_negative_hits = dentry_stats.dentry_negative_hits;
+  st->dentry_misses = dentry_stats.dentry_misses;
+  lock_release (&dentry_lock);
+}
+
+/* Prints directory entry cache statistics. */
+void
+dir_print_stats (void)
+{
+  struct fsstat st;
+
+  dir_get_stats (&st);
+  printf ("Directory entry cache: %lld hits (%lld negative), "
+          "%lld misses\n",
+          st.dentry_hits, st.dentry_negative_hits, st.dentry_misses);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -42,6 +414,8 @@ dir_create (disk_sector_t sector, size_t entry_cnt)
   else
     parent = ROOT_DIR_SECTOR;
 
+  /* Forget names cached for a directory that used SECTOR before. */
+  dentry_purge (sector);
   return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true, parent); // true means creating directory
 //  buffer_read(sector, &temp, 0, DISK_SECTOR_SIZE);
 //  temp.parent = parent;
@@ -104,6 +478,378 @@ dir_get_inode (struct dir *dir)
 }
 
 
+/* Returns the bucket block for hash HASH in indexed DIR. */
+static size_t
+index_slot (const struct dir *dir, uint32_t hash)
+{
+  struct buffcache_elem *b = inode_get_block (dir->inode, 0, false);
+  size_t block;
+
+  if (b == NULL)
+    return 0;
+  block = ((const struct dir_index *) b->data)->slots[hash % DIR_INDEX_SLOTS];
+  buffer_put (b, false);
+  return block;
+}
+
+/* Does what lookup() does, for indexed DIR. */
+static bool
+index_lookup (const struct dir *dir, const char *name,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  size_t block = index_slot (dir, name_hash (name));
+
+  while (block != 0)
+    {
+      struct buffcache_elem *b;
+      const struct dir_bucket *bucket;
+      int i;
+
+      b = inode_get_block (dir->inode, block * DISK_SECTOR_SIZE, false);
+      if (b == NULL)
+        return false;
+      bucket = (const struct dir_bucket *) b->data;
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        {
+          const struct dir_entry *e = &bucket->entries[i];
+          if (e->in_use && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = block * DISK_SECTOR_SIZE
+                        + offsetof (struct dir_bucket, entries[i]);
+              buffer_put (b, false);
+              return true;
+            }
+        }
+      block = bucket->next;
+      buffer_put (b, false);
+    }
+  return false;
+}
+
+/* Writes the SIZE bytes at BUF to DIR at OFS.
+   Returns true if successful, false on a disk error. */
+static bool
+dir_write (struct dir *dir, const void *buf, off_t size, off_t ofs)
+{
+  return inode_write_at (dir->inode, buf, size, ofs) == size;
+}
+
+/* Splits bucket BLOCK of indexed DIR, described by INDEX, moving
+   the entries whose next hash bit is set to a new bucket at the
+   end.  Returns true if successful, false if the disk or memory
+   runs out. */
+static bool
+index_split (struct dir *dir, struct dir_index *index, size_t block)
+{
+  struct dir_bucket *old = malloc (sizeof *old);
+  struct dir_bucket *new = calloc (1, sizeof *new);
+  struct dir_hint *hint = dir_hint (dir);
+  size_t new_block = index->blocks;
+  uint32_t bit;
+  bool success = false;
+  int i, j;
+
+  if (old == NULL || new == NULL
+      || inode_read_at (dir->inode, old, sizeof *old,
+                        block * DISK_SECTOR_SIZE) != sizeof *old)
+    goto done;
+
+  bit = 1u << old->depth;
+  old->depth++;
+  new->depth = old->depth;
+  for (i = j = 0; i < DIR_BUCKET_ENTRIES; i++)
+    if (old->entries[i].in_use && (name_hash (old->entries[i].name) & bit))
+      {
+        new->entries[j++] = old->entries[i];
+        old->entries[i].in_use = false;
+      }
+  for (i = 0; i < DIR_INDEX_SLOTS; i++)
+    if (index->slots[i] == block)
+      {
+        if (hint != NULL)
+          hint->chain_free[i] = 0;
+        if (i & bit)
+          index->slots[i] = new_block;
+      }
+  index->blocks++;
+
+  success = (dir_write (dir, new, sizeof *new, new_block * DISK_SECTOR_SIZE)
+             && dir_write (dir, old, sizeof *old, block * DISK_SECTOR_SIZE)
+             && dir_write (dir, index, sizeof *index, 0));
+ done:
+  free (old);
+  free (new);
+  return success;
+}
+
+/* Adds entry E, whose name DIR does not have, to indexed DIR,
+   splitting its bucket or chaining a new block to it if it is
+   full.  Returns true if successful, false if the disk or memory
+   runs out. */
+static bool
+index_add (struct dir *dir, const struct dir_entry *e)
+{
+  uint32_t hash = name_hash (e->name);
+  struct dir_hint *hint = dir_hint (dir);
+  uint16_t *chain_free = NULL;
+  struct dir_index *index = NULL;
+  struct dir_bucket *bucket = NULL;
+  uint32_t next;
+  bool success = false;
+
+  if (hint != NULL)
+    chain_free = &hint->chain_free[hash % DIR_INDEX_SLOTS];
+  for (;;)
+    {
+      size_t first = index_slot (dir, hash);
+      size_t start = chain_free != NULL && *chain_free != 0 ? *chain_free
+                                                            : first;
+      size_t block = start;
+      size_t last = start;
+      uint32_t depth = 0;
+      off_t ofs = -1;
+
+      /* Look for a free entry along the bucket's chain. */
+      while (block != 0 && ofs < 0)
+        {
+          struct buffcache_elem *b;
+          const struct dir_bucket *chain;
+          int i;
+
+          b = inode_get_block (dir->inode, block * DISK_SECTOR_SIZE, false);
+          if (b == NULL)
+            goto done;
+          chain = (const struct dir_bucket *) b->data;
+          if (block == start)
+            depth = chain->depth;
+          for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+            if (!chain->entries[i].in_use)
+              {
+                ofs = block * DISK_SECTOR_SIZE
+                      + offsetof (struct dir_bucket, entries[i]);
+                break;
+              }
+          last = block;
+          block = chain->next;
+          buffer_put (b, false);
+        }
+      if (ofs >= 0)
+        {
+          success = dir_write (dir, e, sizeof *e, ofs);
+          if (chain_free != NULL)
+            *chain_free = ofs / DISK_SECTOR_SIZE;
+          goto done;
+        }
+
+      if (index == NULL)
+        {
+          index = malloc (sizeof *index);
+          if (index == NULL)
+            goto done;
+        }
+      if (inode_read_at (dir->inode, index, sizeof *index, 0) != sizeof *index)
+        goto done;
+
+      if (depth < DIR_INDEX_BITS)
+        {
+          /* Split and try again. */
+          if (!index_split (dir, index, first))
+            goto done;
+          continue;
+        }
+
+      /* The bucket serves a single slot: chain a new block. */
+      bucket = calloc (1, sizeof *bucket);
+      if (bucket == NULL)
+        goto done;
+      next = index->blocks++;
+      bucket->depth = DIR_INDEX_BITS;
+      bucket->entries[0] = *e;
+      success = (dir_write (dir, bucket, sizeof *bucket,
+                            next * DISK_SECTOR_SIZE)
+                 && dir_write (dir, &next, sizeof next,
+                               last * DISK_SECTOR_SIZE
+                               + offsetof (struct dir_bucket, next))
+                 && dir_write (dir, index, sizeof *index, 0));
+      if (success && chain_free != NULL)
+        *chain_free = next;
+      goto done;
+    }
+
+ done:
+  free (index);
+  free (bucket);
+  return success;
+}
+
+/* An indexed directory built in memory by index_build(): its
+   header, and its buckets, block I being BUCKETS[I - 1]. */
+struct index_image
+  {
+    struct dir_index index;
+    struct dir_bucket *buckets;
+    size_t capacity;                    /* Buckets BUCKETS has room for. */
+  };
+
+/* Appends an empty bucket to IM and returns its block number, or
+   0 if memory runs out. */
+static size_t
+image_new_bucket (struct index_image *im)
+{
+  size_t block = im->index.blocks;
+
+  if (block - 1 == im->capacity)
+    {
+      struct dir_bucket *b = realloc (im->buckets,
+                                      2 * im->capacity * sizeof *b);
+      if (b == NULL)
+        return 0;
+      im->buckets = b;
+      im->capacity *= 2;
+    }
+  memset (&im->buckets[block - 1], 0, sizeof *im->buckets);
+  im->index.blocks++;
+  return block;
+}
+
+/* Adds entry E to IM the way index_add() adds it to a directory
+   on disk.  Returns true if successful, false if memory runs
+   out. */
+static bool
+image_add (struct index_image *im, const struct dir_entry *e)
+{
+  uint32_t hash = name_hash (e->name);
+
+  for (;;)
+    {
+      size_t first = im->index.slots[hash % DIR_INDEX_SLOTS];
+      size_t block, last = first;
+      uint32_t bit;
+      size_t new;
+      int i, j;
+
+      /* Look for a free entry along the bucket's chain. */
+      for (block = first; block != 0; block = im->buckets[block - 1].next)
+        {
+          struct dir_bucket *b = &im->buckets[block - 1];
+          for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+            if (!b->entries[i].in_use)
+              {
+                b->entries[i] = *e;
+                return true;
+              }
+          last = block;
+        }
+
+      new = image_new_bucket (im);
+      if (new == 0)
+        return false;
+
+      if (im->buckets[first - 1].depth >= DIR_INDEX_BITS)
+        {
+          /* The bucket serves a single slot: chain the new one. */
+          im->buckets[new - 1].depth = DIR_INDEX_BITS;
+          im->buckets[new - 1].entries[0] = *e;
+          im->buckets[last - 1].next = new;
+          return true;
+        }
+
+      /* Split and try again. */
+      bit = 1u << im->buckets[first - 1].depth;
+      im->buckets[first - 1].depth++;
+      im->buckets[new - 1].depth = im->buckets[first - 1].depth;
+      for (i = j = 0; i < DIR_BUCKET_ENTRIES; i++)
+        {
+          struct dir_entry *old = &im->buckets[first - 1].entries[i];
+          if (old->in_use && (name_hash (old->name) & bit))
+            {
+              im->buckets[new - 1].entries[j++] = *old;
+              old->in_use = false;
+            }
+        }
+      for (i = 0; i < DIR_INDEX_SLOTS; i++)
+        if (im->index.slots[i] == first && (i & bit))
+          im->index.slots[i] = new;
+    }
+}
+
+/* Rebuilds linear DIR as an indexed directory holding the same
+   entries.  Returns true if successful, false if the disk or
+   memory runs out, in which case DIR is left a linear directory
+   with the same entries.
+
+   The index is built in memory first.  The directory is then
+   grown to its full size with free entries, which is the only
+   step that needs new blocks and so the only one that can run out
+   of disk; until the header goes into block 0, last of all, DIR
+   still reads as linear. */
+static bool
+index_build (struct dir *dir)
+{
+  struct index_image im;
+  struct dir_hint *hint = dir_hint (dir);
+  struct dir_entry *linear = NULL;
+  off_t length = inode_length (dir->inode);
+  off_t end;
+  size_t cnt = length / sizeof *linear, i;
+  bool success = false;
+
+  /* Start with one empty bucket for every slot. */
+  memset (&im.index, 0, sizeof im.index);
+  im.index.magic = DIR_INDEX_MAGIC;
+  im.index.blocks = 1;
+  im.capacity = 4;
+  im.buckets = malloc (im.capacity * sizeof *im.buckets);
+  if (im.buckets == NULL || image_new_bucket (&im) == 0)
+    goto done;
+  for (i = 0; i < DIR_INDEX_SLOTS; i++)
+    im.index.slots[i] = 1;
+
+  /* Read the entries and add those in use. */
+  linear = malloc (length);
+  if (length > 0
+      && (linear == NULL
+          || inode_read_at (dir->inode, linear, length, 0) != length))
+    goto done;
+  for (i = 0; i < cnt; i++)
+    if (linear[i].in_use && !image_add (&im, &linear[i]))
+      goto done;
+
+  /* Grow DIR, then write the buckets and the header. */
+  end = (off_t) im.index.blocks * DISK_SECTOR_SIZE;
+  if (end > length)
+    {
+      void *zeros = calloc (1, end - length);
+      bool grown = (zeros != NULL
+                    && dir_write (dir, zeros, end - length, length));
+      free (zeros);
+      if (!grown)
+        goto done;
+    }
+  if (!dir_write (dir, im.buckets, end - DISK_SECTOR_SIZE, DISK_SECTOR_SIZE)
+      || !dir_write (dir, &im.index, sizeof im.index, 0))
+    {
+      /* Put the linear entries back, and free ones after them. */
+      void *zeros = calloc (1, end - length);
+      if (zeros != NULL)
+        dir_write (dir, zeros, end - length, length);
+      free (zeros);
+      dir_write (dir, linear, length, 0);
+      goto done;
+    }
+  if (hint != NULL)
+    memset (hint->chain_free, 0, sizeof hint->chain_free);
+  success = true;
+
+ done:
+  free (linear);
+  free (im.buckets);
+  return success;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -113,26 +859,30 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
+  struct dir_cursor c;
+  const struct dir_entry *e;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
+  if (index_blocks (dir) > 0)
+    return index_lookup (dir, name, ep, ofsp);
+
+  cursor_init (&c);
+  for (ofs = 0; (e = cursor_get (dir, &c, ofs)) != NULL; ofs += sizeof *e)
   {
-    //printf("in lookup e.name is %s\n",  e.name);
-    if (e.in_use && !strcmp (name, e.name)) 
+    if (e->in_use && !strcmp (name, e->name)) 
       {
         if (ep != NULL)
-          *ep = e;
+          *ep = *e;
         if (ofsp != NULL)
           *ofsp = ofs;
-        //printf("in lookup return true\n");
+        cursor_done (&c);
         return true;
       }
   }
+  cursor_done (&c);
   return false;
 }
 
@@ -145,6 +895,7 @@ dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
   struct dir_entry e;
+  disk_sector_t parent, sector;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
@@ -156,11 +907,16 @@ dir_lookup (const struct dir *dir, const char *name,
     *inode = NULL;
   */
   
-  if( lookup(dir, name, &e, NULL) )
+  inode_dir_lock(dir->inode);
+  parent = inode_get_inumber(dir->inode);
+  if(dentry_get(parent, name, &sector))
+    *inode = sector != DENTRY_NEGATIVE ? inode_open(sector) : NULL;
+  else if( lookup(dir, name, &e, NULL) )
   {
     if(e.in_use)
     {
       //printf("in dir_lookup, exists\n");
+      dentry_put(parent, name, e.inode_sector);
       *inode = inode_open(e.inode_sector);
       //printf("in dir_lookup, after inode_open(e.inode_sector)\n");
     }
@@ -171,7 +927,11 @@ dir_lookup (const struct dir *dir, const char *name,
     }
   }
   else
+  {
+    dentry_put(parent, name, DENTRY_NEGATIVE);
     *inode = NULL;
+  }
+  inode_dir_unlock(dir->inode);
   //printf("dir_lookup end\n");
 //  if(*inode != NULL)
 //    printf("success\n");
@@ -201,33 +961,14 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  /* Hold the directory from the check until the slot is
+     written, so that two adds of NAME cannot both succeed. */
+  inode_dir_lock (dir->inode);
+
+  /* Check that DIR has not been removed and NAME is not in use. */
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-
-  int i=0;
-  //printf("size of e is %d\n", sizeof e);
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-  {
-    i++;
-    //printf("aa ");
-    //printf("dir_entry name is %s\n", e.name);
-    if (!e.in_use)
-    {
-      //printf("not in use, i is %d\n", i);
-      break;
-    }
-  }
-  /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
@@ -242,23 +983,109 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
     e.parent = ROOT_DIR_SECTOR;
   }
   */
+  if (index_blocks (dir) > 0)
+    {
+      success = index_add (dir, &e);
+      goto added;
+    }
+
+  /* Set OFS to offset of free slot.
+     If there are no free slots, then it will be set to the
+     current end-of-file. */
+  struct dir_cursor c;
+  const struct dir_entry *slot;
+  struct dir_hint *hint = dir_hint (dir);
+
+  cursor_init (&c);
+  for (ofs = hint != NULL ? hint->free_ofs : 0;
+       (slot = cursor_get (dir, &c, ofs)) != NULL; ofs += sizeof e)
+    if (!slot->in_use)
+      break;
+  cursor_done (&c);
+
+  /* A linear directory about to outgrow its inode is indexed
+     instead. */
+  if (slot == NULL && ofs + (off_t) sizeof e > INODE_INLINE_MAX)
+    {
+      success = index_build (dir) && index_add (dir, &e);
+      goto added;
+    }
+
+  /* Write slot. */
   //printf("in dir_add , name is %s\n", name);
   //printf("ofs is %d\n", ofs);
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success && hint != NULL)
+    hint->free_ofs = ofs + sizeof e;
   
+ added:
+  if (success)
+    dentry_put (inode_get_inumber (dir->inode), name, inode_sector);
  done:
+  inode_dir_unlock (dir->inode);
   //printf("dir_add end\n");
   return success;
 }
 
-/* Removes any entry for NAME in DIR.
+/* Notes in DIR's hint that the entry at OFS, which was for NAME,
+   is now free. */
+static void
+hint_free (struct dir *dir, const char *name, off_t ofs)
+{
+  struct dir_hint *hint = dir_hint (dir);
+  uint16_t *chain_free;
+
+  if (hint == NULL)
+    return;
+  if (index_blocks (dir) > 0)
+    {
+      chain_free = &hint->chain_free[name_hash (name) % DIR_INDEX_SLOTS];
+      if (*chain_free > ofs / DISK_SECTOR_SIZE)
+        *chain_free = ofs / DISK_SECTOR_SIZE;
+    }
+  else if (hint->free_ofs > ofs)
+    hint->free_ofs = ofs;
+}
+
+/* Returns true if DIR has no entries.  The caller must hold the
+   lock taken by inode_dir_lock() on DIR's inode. */
+static bool
+is_empty (struct dir *dir)
+{
+  struct dir_cursor c;
+  const struct dir_entry *e;
+  off_t ofs;
+  size_t blocks;
+  off_t end;
+  bool empty = true;
+
+  blocks = index_blocks (dir);
+  end = dir_end (dir, blocks);
+  cursor_init (&c);
+  for (ofs = next_slot (blocks, 0);
+       ofs + (off_t) sizeof *e <= end && (e = cursor_get (dir, &c, ofs)) != NULL;
+       ofs = next_slot (blocks, ofs + sizeof *e))
+    if (e->in_use)
+      {
+        empty = false;
+        break;
+      }
+  cursor_done (&c);
+  return empty;
+}
+
+/* Removes any entry for NAME in DIR.  A directory is removed only
+   if it is empty.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs if there is no file with the given NAME or it is
+   a directory that is not empty. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  struct dir target;
+  bool locked = false;
   bool success = false;
   off_t ofs;
 
@@ -267,6 +1094,8 @@ dir_remove (struct dir *dir, const char *name)
   
   //printf("dir_remove, name is %s\n", name);
 
+  inode_dir_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -275,6 +1104,18 @@ dir_remove (struct dir *dir, const char *name)
   inode = inode_open (e.inode_sector);
   if (inode == NULL)
     goto done;
+
+  /* Hold a directory from the emptiness check until it is marked
+     removed, so that dir_add() cannot slip an entry in between. */
+  if (inode_is_dir (inode))
+    {
+      target.inode = inode;
+      target.pos = 0;
+      inode_dir_lock (inode);
+      locked = true;
+      if (!is_empty (&target))
+        goto done;
+    }
   //printf("middle in dir_remove\n");
   /* Erase directory entry. */
   e.in_use = false;
@@ -283,9 +1124,15 @@ dir_remove (struct dir *dir, const char *name)
   //printf("after middle\n");
   /* Remove inode. */
   inode_remove (inode);
+  dentry_put (inode_get_inumber (dir->inode), name, DENTRY_NEGATIVE);
+  dentry_purge (e.inode_sector);
+  hint_free (dir, name, ofs);
   success = true;
   //printf("dir_remove success\n");
  done:
+  if (locked)
+    inode_dir_unlock (inode);
+  inode_dir_unlock (dir->inode);
   inode_close (inode);
   return success;
 }
@@ -297,18 +1144,75 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  size_t blocks;
+  off_t end;
+  bool found = false;
+
   //printf("in dir_readdir pos is %d\n", dir->pos);
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  inode_dir_lock (dir->inode);
+  blocks = index_blocks (dir);
+  end = dir_end (dir, blocks);
+  while ((dir->pos = next_slot (blocks, dir->pos)) + (off_t) sizeof e <= end
+         && inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
       //printf("pos is %d\n", dir->pos);
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
+          break;
         } 
     }
-  return false;
+  inode_dir_unlock (dir->inode);
+  return found;
+}
+
+/* Reads up to CNT entries of DIR into ENTS, continuing from where
+   the last call to this function or dir_readdir() stopped.
+   Returns the number read, which is less than CNT only at the end
+   of the directory.  The entries are read in place from the
+   buffer cache, under a single hold of DIR's lock. */
+size_t
+dir_getdents (struct dir *dir, struct dirent *ents, size_t cnt)
+{
+  struct dir_cursor c;
+  const struct dir_entry *e;
+  size_t blocks, n = 0, i;
+  off_t end;
+
+  ASSERT (NAME_MAX <= DIRENT_NAME_MAX);
+
+  inode_dir_lock (dir->inode);
+  blocks = index_blocks (dir);
+  end = dir_end (dir, blocks);
+  cursor_init (&c);
+  while (n < cnt
+         && (dir->pos = next_slot (blocks, dir->pos)) + (off_t) sizeof *e <= end
+         && (e = cursor_get (dir, &c, dir->pos)) != NULL)
+    {
+      dir->pos += sizeof *e;
+      if (e->in_use)
+        {
+          ents[n].inumber = e->inode_sector;
+          strlcpy (ents[n].name, e->name, sizeof ents[n].name);
+          n++;
+        }
+    }
+  cursor_done (&c);
+
+  /* Entries do not record their file's type, so look it up in
+     the inodes, still holding the lock so that none of them can
+     be removed meanwhile. */
+  for (i = 0; i < n; i++)
+    {
+      struct inode *inode = inode_open (ents[i].inumber);
+      ents[i].type = (inode != NULL && inode_is_dir (inode)
+                      ? DIRENT_DIR : DIRENT_FILE);
+      inode_close (inode);
+    }
+  inode_dir_unlock (dir->inode);
+  return n;
 }
 
 struct dir *
@@ -395,28 +1299,12 @@ dir_goto_path(char * dir, char * real_name)
 bool
 dir_is_empty(struct dir * dir)
 {
-//  printf("dir is empty\n");
-  struct inode * inode = dir->inode;
-  struct dir_entry e;
-  off_t ofs;
-  ofs = 0;  
-  if(inode == NULL)
-    printf("inode is NULL\n");
-
-  for(ofs = 0; inode_read_at(inode, &e, sizeof e, ofs) == sizeof e; 
-      ofs += sizeof e)
-  {
-    if(e.in_use)
-    {
-//      printf("dir_is_empty return\n");
-      return false;
-    }
-//    else
-//      printf("hihi\n");
-  }
-//  printf("return true\n");
-  return true;
+  bool empty;
 
+  inode_dir_lock(dir->inode);
+  empty = is_empty(dir);
+  inode_dir_unlock(dir->inode);
+  return empty;
 }
 
 
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <dirent.h>
+#include <fsstat.h>
 #include "devices/disk.h"
 
 /* Maximum length of a file name component.
@@ -13,6 +15,8 @@
 
 struct inode;
 
+void dir_init (void);
+
 /* Opening and closing directories. */
 bool dir_create (disk_sector_t sector, size_t entry_cnt);
 struct dir *dir_open (struct inode *);
@@ -26,7 +30,10 @@ bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, disk_sector_t);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+size_t dir_getdents (struct dir *, struct dirent *, size_t cnt);
 
 struct dir * dir_goto_path(char *, char *);
 bool dir_is_empty(struct dir *);
+void dir_get_stats (struct fsstat *);
+void dir_print_stats (void);
 #endif /* filesys/directory.h */
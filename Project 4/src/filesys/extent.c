@@ -0,0 +1,425 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+
+/* Extent tree.
+
+   An extent inode maps its blocks with a B+-tree of extents
+   whose root is the extents[] array in the inode itself.  When
+   extent_depth is 0 the root entries are the extents; otherwise
+   each root entry points to a node one sector long, and so on
+   down extent_depth levels to the leaves.  Entries at every
+   level are sorted by block, and an entry above the leaves holds
+   the first block of the subtree it points to.
+
+   Blocks that no extent maps are holes, which read as zeros.
+   Filling a hole inserts an extent at its place in the leaves.
+   A full node splits into a new sibling, which takes the entries
+   after the new one, or just the new one when it goes last, so
+   that a file written from start to end packs its nodes full; a
+   full root moves its entries into a new node below it and the
+   tree grows one level. */
+
+/* Entries in a node below the root. */
+#define EXTENT_NODE_NUM 42
+
+/* Most levels the tree can have below the root.  EXTENT_ROOT_NUM
+   * EXTENT_NODE_NUM**5 extents is more than a disk can hold. */
+#define EXTENT_DEPTH_MAX 5
+
+/* Extent tree node below the root.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_node
+{
+  uint32_t cnt;                         /* Entries used. */
+  uint32_t unused;                      /* Not used. */
+  struct extent entries[EXTENT_NODE_NUM];
+};
+
+/* Sectors set aside for the nodes that one insertion may need, so
+   that it cannot fail halfway through. */
+struct node_pool
+{
+  disk_sector_t sectors[EXTENT_DEPTH_MAX + 2];
+  int cnt;
+};
+
+/* Returns the index of the last of the CNT ENTRIES that starts at
+   or before BLOCK, or -1 if there is none. */
+static int
+extent_search(const struct extent * entries, uint32_t cnt, size_t block)
+{
+  int lo = 0;
+  int hi = cnt;
+
+  while(lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if(entries[mid].block <= block)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+/* Returns true if leaf extent E ends just where NEW begins, both
+   in the file and on disk, so that NEW can lengthen it. */
+static bool
+continues(const struct extent * e, const struct extent * new)
+{
+  return e->block + e->cnt == new->block && e->start + e->cnt == new->start;
+}
+
+/* Returns the sector that holds file block BLOCK of DISK_INODE,
+   or -1 if BLOCK is in a hole.  If FOUND is nonnull, also stores
+   there the extent that maps BLOCK, or for a hole, an extent
+   with start -1 that spans the hole; a hole past the last extent
+   ends at the largest block number. */
+disk_sector_t
+extent_lookup(const struct inode_disk * disk_inode, size_t block,
+              struct extent * found)
+{
+  uint32_t depth = disk_inode->extent_depth;
+  uint32_t hole_end = UINT32_MAX;
+  struct extent e;
+  int i;
+
+  ASSERT(sizeof(struct extent_node) == DISK_SECTOR_SIZE);
+
+  i = extent_search(disk_inode->extents, disk_inode->extent_cnt, block);
+  if(i + 1 < (int) disk_inode->extent_cnt)
+    hole_end = disk_inode->extents[i + 1].block;
+  if(i < 0)
+  {
+    e.block = e.cnt = 0;
+    goto hole;
+  }
+  e = disk_inode->extents[i];
+  for(; depth > 0; depth--)
+  {
+    struct buffcache_elem * b = buffer_get(e.start, false, FSSTAT_INDIRECT);
+    const struct extent_node * node = (const struct extent_node *) b->data;
+
+    /* The subtree starts at or before BLOCK, so I >= 0. */
+    i = extent_search(node->entries, node->cnt, block);
+    if(i + 1 < (int) node->cnt)
+      hole_end = node->entries[i + 1].block;
+    e = node->entries[i];
+    buffer_put(b, false);
+  }
+  if(block < e.block + e.cnt)
+  {
+    if(found != NULL)
+      *found = e;
+    return e.start + (block - e.block);
+  }
+
+ hole:
+  if(found != NULL)
+  {
+    found->block = e.block + e.cnt;
+    found->start = -1;
+    found->cnt = hole_end - found->block;
+  }
+  return -1;
+}
+
+/* Returns the number of nodes that inserting NEW into DISK_INODE's
+   tree will add: one for each full level, counting up from the
+   leaves, that NEW splits, and one more if the root splits. */
+static int
+nodes_needed(const struct inode_disk * disk_inode, const struct extent * new)
+{
+  const struct extent * entries = disk_inode->extents;
+  uint32_t cnt = disk_inode->extent_cnt;
+  uint32_t max = EXTENT_ROOT_NUM;
+  uint32_t depth = disk_inode->extent_depth;
+  struct buffcache_elem * b = NULL;
+  disk_sector_t child;
+  int full = 0;
+  int i;
+
+  ASSERT(depth <= EXTENT_DEPTH_MAX);
+  for(;;)
+  {
+    full = cnt < max ? 0 : full + 1;
+    i = extent_search(entries, cnt, new->block);
+    if(depth == 0)
+      break;
+    if(i < 0)
+      i = 0;
+    child = entries[i].start;
+    if(b != NULL)
+      buffer_put(b, false);
+    b = buffer_get(child, false, FSSTAT_INDIRECT);
+    entries = ((const struct extent_node *) b->data)->entries;
+    cnt = ((const struct extent_node *) b->data)->cnt;
+    max = EXTENT_NODE_NUM;
+    depth--;
+  }
+  if(i >= 0 && continues(&entries[i], new))
+    full = 0;
+  if(b != NULL)
+    buffer_put(b, false);
+
+  /* Every level from the leaves up splits only if all are full. */
+  if(full == (int) disk_inode->extent_depth + 1)
+    full++;
+  return full;
+}
+
+/* Returns a sector from POOL, holding an empty node. */
+static disk_sector_t
+pool_take(struct node_pool * pool)
+{
+  static char zeros[DISK_SECTOR_SIZE];
+  disk_sector_t sector;
+
+  ASSERT(pool->cnt > 0);
+  sector = pool->sectors[--pool->cnt];
+  buffer_write(sector, zeros, 0, DISK_SECTOR_SIZE, FSSTAT_INDIRECT);
+  return sector;
+}
+
+/* Puts ENTRY at index POS of the *CNT ENTRIES, which have room
+   for MAX.  If they are full, splits them first with a new
+   sibling from POOL, stores the entry that points to the sibling
+   in *SPILL, and returns true; otherwise returns false. */
+static bool
+place(struct extent * entries, uint32_t * cnt, uint32_t max, uint32_t pos,
+      const struct extent * entry, struct node_pool * pool,
+      struct extent * spill)
+{
+  struct buffcache_elem * b;
+  struct extent_node * node;
+  uint32_t half;
+
+  if(*cnt < max)
+  {
+    memmove(&entries[pos + 1], &entries[pos],
+            (*cnt - pos) * sizeof * entries);
+    entries[pos] = *entry;
+    (*cnt)++;
+    return false;
+  }
+
+  spill->start = pool_take(pool);
+  spill->cnt = 0;
+  b = buffer_get(spill->start, true, FSSTAT_INDIRECT);
+  node = (struct extent_node *) b->data;
+  if(pos == *cnt)
+  {
+    node->entries[node->cnt++] = *entry;
+    spill->block = entry->block;
+    buffer_put(b, true);
+    return true;
+  }
+
+  half = *cnt / 2;
+  node->cnt = *cnt - half;
+  memcpy(node->entries, &entries[half], node->cnt * sizeof * entries);
+  *cnt = half;
+  if(pos <= half)
+    place(entries, cnt, max, pos, entry, pool, NULL);
+  else
+    place(node->entries, &node->cnt, EXTENT_NODE_NUM, pos - half, entry,
+          pool, NULL);
+  spill->block = node->entries[0].block;
+  buffer_put(b, true);
+  return true;
+}
+
+/* Inserts extent NEW, which maps only blocks in a hole, into the
+   subtree whose top level is the *CNT ENTRIES, with room for
+   MAX, DEPTH levels above the leaves.  A leaf extent that NEW
+   continues on disk is lengthened instead.  Nodes split as
+   needed, taking their sectors from POOL; if the top level
+   itself splits, the entry for its new sibling is stored in
+   *SPILL and true is returned. */
+static bool
+insert(struct extent * entries, uint32_t * cnt, uint32_t max, uint32_t depth,
+       const struct extent * new, struct node_pool * pool,
+       struct extent * spill)
+{
+  struct extent entry = *new;
+  int i = extent_search(entries, *cnt, new->block);
+
+  if(depth == 0)
+  {
+    if(i >= 0 && continues(&entries[i], new))
+    {
+      entries[i].cnt += new->cnt;
+      return false;
+    }
+  }
+  else
+  {
+    struct buffcache_elem * b;
+    struct extent_node * child;
+    bool split;
+
+    /* A block before the whole tree goes into the first subtree,
+       which then starts at it. */
+    if(i < 0)
+    {
+      i = 0;
+      entries[0].block = new->block;
+    }
+    b = buffer_get(entries[i].start, true, FSSTAT_INDIRECT);
+    child = (struct extent_node *) b->data;
+    split = insert(child->entries, &child->cnt, EXTENT_NODE_NUM, depth - 1,
+                   new, pool, &entry);
+    buffer_put(b, true);
+    if(!split)
+      return false;
+  }
+  return place(entries, cnt, max, i + 1, &entry, pool, spill);
+}
+
+/* Inserts extent NEW, which maps only blocks in a hole, into
+   DISK_INODE's tree, with new nodes allocated near HINT.
+   Returns true if successful, false on running out of disk
+   space, in which case the tree is unchanged. */
+static bool
+tree_insert(struct inode_disk * disk_inode, const struct extent * new,
+            disk_sector_t hint)
+{
+  struct node_pool pool;
+  struct buffcache_elem * b;
+  struct extent_node * node;
+  struct extent spill;
+  int needed = nodes_needed(disk_inode, new);
+
+  for(pool.cnt = 0; pool.cnt < needed; pool.cnt++)
+    if(free_map_allocate_run(hint, 1, &pool.sectors[pool.cnt]) == 0)
+    {
+      while(pool.cnt > 0)
+        free_map_release(pool.sectors[--pool.cnt], 1);
+      return false;
+    }
+
+  if(insert(disk_inode->extents, &disk_inode->extent_cnt, EXTENT_ROOT_NUM,
+            disk_inode->extent_depth, new, &pool, &spill))
+  {
+    /* The root split.  Move what it kept into a new node and
+       point the root at that node and the spilled one. */
+    disk_sector_t sector = pool_take(&pool);
+
+    ASSERT(EXTENT_ROOT_NUM <= EXTENT_NODE_NUM);
+    b = buffer_get(sector, true, FSSTAT_INDIRECT);
+    node = (struct extent_node *) b->data;
+    node->cnt = disk_inode->extent_cnt;
+    memcpy(node->entries, disk_inode->extents,
+           disk_inode->extent_cnt * sizeof * node->entries);
+    buffer_put(b, true);
+
+    disk_inode->extents[0].start = sector;
+    disk_inode->extents[0].cnt = 0;
+    disk_inode->extents[1] = spill;
+    disk_inode->extent_cnt = 2;
+    disk_inode->extent_depth++;
+  }
+  ASSERT(pool.cnt == 0);
+  return true;
+}
+
+/* Gives the holes among the CNT blocks of DISK_INODE from FIRST
+   on newly allocated blocks, filled with zeros if ZERO, which the
+   buffer cache counts under class CLS.  Each hole's blocks are allocated
+   in runs that continue the extent before it when the free map
+   allows, from window W first if W is nonnull.
+   Returns true if successful, false if the disk runs out, in
+   which case the blocks already added stay. */
+bool
+extent_fill(struct inode_disk * disk_inode, size_t first, size_t cnt,
+            enum fsstat_class cls, bool zero, struct free_map_window * w)
+{
+  static char zeros[DISK_SECTOR_SIZE];
+  size_t block = first;
+  size_t end = first + cnt;
+
+  while(block < end)
+  {
+    struct extent hole, prev, new;
+    disk_sector_t hint;
+    size_t want, i;
+
+    if(extent_lookup(disk_inode, block, &hole) != (disk_sector_t) -1)
+    {
+      block = hole.block + hole.cnt;
+      continue;
+    }
+
+    /* Aim for where the blocks would be if the extent before the
+       hole ran on through it. */
+    hint = disk_inode->extent_next;
+    if(hole.block > 0
+       && extent_lookup(disk_inode, hole.block - 1, &prev) != (disk_sector_t) -1)
+      hint = prev.start + prev.cnt + (block - hole.block);
+
+    want = hole.block + hole.cnt < end ? hole.block + hole.cnt - block
+                                       : end - block;
+    new.block = block;
+    if(w != NULL)
+      new.cnt = free_map_window_take(w, hint, want, &new.start);
+    else
+      new.cnt = free_map_allocate_run(hint, want, &new.start);
+    if(new.cnt == 0)
+      return false;
+    for(i = 0; zero && i < new.cnt; i++)
+      buffer_write(new.start + i, zeros, 0, DISK_SECTOR_SIZE, cls);
+
+    if(!tree_insert(disk_inode, &new, new.start + new.cnt))
+    {
+      free_map_release(new.start, new.cnt);
+      return false;
+    }
+    disk_inode->extent_next = new.start + new.cnt;
+    disk_inode->extent_blocks += new.cnt;
+    block += new.cnt;
+  }
+  return true;
+}
+
+/* Frees the blocks of the subtree that E points to, DEPTH levels
+   above the leaves, and the nodes that map them. */
+static void
+release(const struct extent * e, uint32_t depth)
+{
+  struct buffcache_elem * b;
+  const struct extent_node * node;
+  uint32_t i;
+
+  if(depth == 0)
+  {
+    free_map_release(e->start, e->cnt);
+    return;
+  }
+
+  /* Keep the node pinned while walking it; the tree is shallow. */
+  b = buffer_get(e->start, false, FSSTAT_INDIRECT);
+  node = (const struct extent_node *) b->data;
+  for(i = 0; i < node->cnt; i++)
+    release(&node->entries[i], depth - 1);
+  buffer_put(b, false);
+  free_map_release(e->start, 1);
+}
+
+/* Frees all of DISK_INODE's blocks and its extent tree, leaving
+   it with none. */
+void
+extent_release(struct inode_disk * disk_inode)
+{
+  uint32_t i;
+
+  for(i = 0; i < disk_inode->extent_cnt; i++)
+    release(&disk_inode->extents[i], disk_inode->extent_depth);
+  disk_inode->extent_cnt = 0;
+  disk_inode->extent_depth = 0;
+  disk_inode->extent_blocks = 0;
+}
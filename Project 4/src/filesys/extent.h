@@ -0,0 +1,18 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <fsstat.h>
+#include "devices/disk.h"
+
+struct inode_disk;
+struct extent;
+struct free_map_window;
+
+disk_sector_t extent_lookup(const struct inode_disk *, size_t, struct extent *);
+bool extent_fill(struct inode_disk *, size_t, size_t, enum fsstat_class,
+                 bool, struct free_map_window *);
+void extent_release(struct inode_disk *);
+
+#endif /* filesys/extent.h */
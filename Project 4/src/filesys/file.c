@@ -1,6 +1,7 @@
 #include "filesys/file.h"
 #include <debug.h>
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* An open file. */
@@ -90,11 +91,19 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
    which may be less than SIZE if end of file is reached.
    (Normally we'd grow the file in that case, but file growth is
    not yet implemented.)
-   Advances FILE's position by the number of bytes read. */
+   Advances FILE's position by the number of bytes read.
+   Under the journal, a write that runs short of disk space while
+   sectors freed lately wait for their free to commit is tried
+   again once it has, in a new handle. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
   off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  if (bytes_written < size && journal_retry_alloc ())
+    bytes_written += inode_write_at (file->inode,
+                                     (const uint8_t *) buffer + bytes_written,
+                                     size - bytes_written,
+                                     file->pos + bytes_written);
   file->pos += bytes_written;
   return bytes_written;
 }
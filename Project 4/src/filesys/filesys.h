@@ -11,10 +11,15 @@
 /* Disk used for file system. */
 extern struct disk *filesys_disk;
 
+struct fsstat;
+
 void filesys_init (bool format);
 void filesys_done (void);
+void filesys_crash (void);
 bool filesys_create (const char *name, off_t initial_size);
 struct file *filesys_open (const char *name);
 bool filesys_remove (const char *name);
+void filesys_get_stats (struct fsstat *);
+void filesys_print_stats (void);
 
 #endif /* filesys/filesys.h */
@@ -1,421 +1,485 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
 #include <round.h>
 
+/* Sectors per entry in the free map summary. */
+#define FREE_MAP_CHUNK 256
+
+/* Sectors per allocation group.  New directories go to the group
+   with the most free space; their files' inodes, and the files'
+   data, are placed after them in the same group when it has
+   room, so that related sectors stay close together. */
+#define FREE_MAP_GROUP (4 * FREE_MAP_CHUNK)
+
+/* Sectors whose bits share one sector of the free map file. */
+#define FREE_MAP_SECTOR_BITS (DISK_SECTOR_SIZE * 8)
+
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
 
-/* Initializes the free map. */
-void
-free_map_init (void) 
-{
-  lock_init(&free_map_lock);
-  free_map = bitmap_create (disk_size (filesys_disk));
-  if (free_map == NULL)
-    PANIC ("bitmap creation failed--disk is too large");
-  bitmap_mark (free_map, FREE_MAP_SECTOR);
-  bitmap_mark (free_map, ROOT_DIR_SECTOR);
-}
-
-bool
-free_map_allocate_one(disk_sector_t * sectorp)
+/* Summary of the free map, kept in step with it under
+   free_map_lock, so that allocation can skip full regions of
+   the disk instead of testing every bit. */
+static uint16_t *chunk_free;         /* Free sectors in each chunk. */
+static size_t chunk_cnt;             /* Number of chunks. */
+static size_t free_cnt;              /* Free sectors on the disk. */
+static size_t cursor;                /* Where the next search starts. */
+
+/* Sectors of the free map file whose bits have changed since they
+   were last written, one bit each.  free_map_flush() writes them. */
+static struct bitmap *free_map_dirty;
+
+/* Sectors held back from allocation, one bit per disk sector:
+   those in the preallocation windows of open files, and under the
+   journal those freed by a transaction that has not committed
+   yet.  Allocation skips them and the summary counts them as
+   used, but they are free in FREE_MAP, so a crash cannot leak
+   them. */
+static struct bitmap *free_map_reserved;
+
+/* Sectors freed since the last commit took the frees, and those
+   freed before that, whose free is being committed, one bit per
+   disk sector.  Reused before its free commits, a sector could
+   end up in use twice after a crash, so free_map_commit_take()
+   and free_map_commit_done() keep them reserved until then. */
+static struct bitmap *free_map_freed;
+static struct bitmap *free_map_committing;
+
+/* Returns true if SECTOR is neither in use nor reserved. */
+static bool
+is_free (size_t sector)
 {
-  lock_acquire(&free_map_lock);
-  disk_sector_t sector = bitmap_scan_and_flip(free_map, 0, 1, false);
-//  printf("in allocate_one, sector is %d\n", sector);
-  if(sector != BITMAP_ERROR && bitmap_write(free_map, free_map_file))
-    *sectorp = sector;
-  lock_release(&free_map_lock);
-  return sector != BITMAP_ERROR;
+  return !bitmap_test (free_map, sector)
+         && !bitmap_test (free_map_reserved, sector);
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
-   Returns true if successful, false if all sectors were
-   available. */
-bool
-free_map_allocate(size_t cnt, struct inode_disk * disk_inode)
+/* Subtracts CNT sectors from START from the summary if USED,
+   adds them back otherwise. */
+static void
+summary_update (size_t start, size_t cnt, bool used)
 {
- // printf("free_map_allocate start, cnt is %d\n",cnt);
- 
-  lock_acquire(&free_map_lock);
-  size_t free_slot = bitmap_count(free_map, 0, bitmap_size(free_map)-1, false);
-  if(free_slot < cnt)
-  {
-    lock_release(&free_map_lock);
-    return false;
-  }
-  int i,j;
-  disk_sector_t target;
-  disk_sector_t single_indirect;
-  disk_sector_t double_indirect;
-  disk_sector_t * single;
+  size_t end = start + cnt;
 
-
-  if(cnt <= DIRECT_NUM) // DIRECT case
-  {
-    for(i=0; i<DIRECT_NUM; i++)
+  while (start < end)
     {
-      if(i<=cnt-1) // if cnt ==0, cnt-1 can be interpreted as unsigned?
-      {
-        target = bitmap_scan_and_flip(free_map, 0, 1, false);
-        disk_inode->direct[i] = target;
-      }
+      size_t c = start / FREE_MAP_CHUNK;
+      size_t chunk_end = (c + 1) * FREE_MAP_CHUNK;
+      size_t n = (chunk_end < end ? chunk_end : end) - start;
+
+      if (used)
+        chunk_free[c] -= n;
       else
-        disk_inode->direct[i] = -1;
-    }
-    if(free_map_file == NULL) // when this function is called by free_map_create, free_map_file is NULL.
-    {
-      lock_release(&free_map_lock);
-      return target != BITMAP_ERROR;
-    }
-    bitmap_write(free_map, free_map_file);
-    lock_release(&free_map_lock);
-    return true;
-  }
-  else if(cnt > DIRECT_NUM && cnt <= (DIRECT_NUM + DISK_SECTOR_SIZE/4)) // single_indirect case
-  {
-    for(i=0; i<DIRECT_NUM; i++)
-    {
-      target = bitmap_scan_and_flip(free_map, 0, 1, false);
-      disk_inode->direct[i] = target;
+        chunk_free[c] += n;
+      start += n;
     }
-    bitmap_write(free_map, free_map_file);
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+}
 
-    //single indirect
-    single_indirect = bitmap_scan_and_flip(free_map, 0, 1, false);
-    disk_inode->single_indirect = single_indirect;
-    single = malloc(DISK_SECTOR_SIZE);
+/* Recounts the free sectors in every chunk of the free map. */
+static void
+summary_build (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t c;
 
-    for(i=0; i< DISK_SECTOR_SIZE/4; i++)
-    {
-      if(i<=cnt - DIRECT_NUM -1)
-      {
-        target = bitmap_scan_and_flip(free_map, 0, 1, false);
-        single[i] = target;
-      }
-      else
-        single[i] = -1;
-    }
-    bitmap_write(free_map, free_map_file);
-    buffer_write(single_indirect, single, 0, DISK_SECTOR_SIZE);
-    free(single);
-    lock_release(&free_map_lock);
-    return true;
-  }
-  else // double_indirect case
-  {
-    // doing direct allocation
-    for(i=0; i<DIRECT_NUM; i++)
+  free_cnt = 0;
+  for (c = 0; c < chunk_cnt; c++)
     {
-      disk_inode->direct[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
+      size_t start = c * FREE_MAP_CHUNK;
+      size_t end = start + FREE_MAP_CHUNK < size ? start + FREE_MAP_CHUNK : size;
+      chunk_free[c] = bitmap_count (free_map, start, end - start, false)
+                      - bitmap_count (free_map_reserved, start, end - start,
+                                      true);
+      free_cnt += chunk_free[c];
     }
-    bitmap_write(free_map, free_map_file);
-    
-    // doing single_indirect allocation.
-    single_indirect = bitmap_scan_and_flip(free_map, 0, 1, false);
-    disk_inode->single_indirect = single_indirect;
-    single = malloc(DISK_SECTOR_SIZE);
-
-    for(i=0; i<DISK_SECTOR_SIZE/4; i++)
-    {
-      single[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-    }
-    bitmap_write(free_map, free_map_file);
-    buffer_write(single_indirect, single, 0, DISK_SECTOR_SIZE);
-    free(single);
-
-    //doing double_indirect allocation
-    double_indirect = bitmap_scan_and_flip(free_map, 0, 1, false);
-    disk_inode->double_indirect = double_indirect;
-    disk_sector_t * double_table = malloc(DISK_SECTOR_SIZE);
-    disk_sector_t * single = malloc(DISK_SECTOR_SIZE);
-    off_t double_pos = cnt - DOUBLE_INDIRECT_START;
-    off_t single_pos = double_pos % (512 * 128);
+  cursor = 0;
+}
 
-    int double_cnt = cnt - DOUBLE_INDIRECT_START;
+/* Marks the CNT sectors from START, which must all be free if
+   USED and all in use otherwise, as USED, and updates the
+   summary to match. */
+static void
+mark (size_t start, size_t cnt, bool used)
+{
+  size_t end = start + cnt;
 
-    disk_sector_t entry_num_in_double = DIV_ROUND_UP(double_cnt, (512 * 128));
-    int temp = double_cnt % (512 * 128);
-    int entry_num_in_single = DIV_ROUND_UP(temp, DISK_SECTOR_SIZE);
+  bitmap_set_multiple (free_map, start, cnt, used);
+  bitmap_set_multiple (free_map_dirty, start / FREE_MAP_SECTOR_BITS,
+                       (end - 1) / FREE_MAP_SECTOR_BITS
+                       - start / FREE_MAP_SECTOR_BITS + 1, true);
+  summary_update (start, cnt, used);
+}
 
+/* Reserves the CNT free sectors from START for a window if
+   RESERVED, or returns them to the pool otherwise.  Unlike mark(),
+   leaves the free map itself alone. */
+static void
+reserve (size_t start, size_t cnt, bool reserved)
+{
+  bitmap_set_multiple (free_map_reserved, start, cnt, reserved);
+  summary_update (start, cnt, reserved);
+}
 
-    for(i=0; i<entry_num_in_double; i++)
-    {
-      double_table[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-      
-      if(i!=entry_num_in_double-1) // do fully allocate single_indirect
-      {
-        for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-        {
-          single[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-        }
-        buffer_write(double_table[i], single, 0, DISK_SECTOR_SIZE);
-      }
-      else
-      {
-        for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-        {
-          if(j<entry_num_in_single)
-          {
-            single[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-          }
-          else
-          {
-            single[j] = -1;
-          }
-        }
-        buffer_write(double_table[i], single, 0, DISK_SECTOR_SIZE);
-      }
-    }
-    for(i=entry_num_in_double; i<DISK_SECTOR_SIZE/4; i++)
+/* Returns the first free sector at or after START and before
+   LIMIT, skipping chunks with none, or BITMAP_ERROR if there is
+   none. */
+static size_t
+next_free_before (size_t start, size_t limit)
+{
+  if (limit > bitmap_size (free_map))
+    limit = bitmap_size (free_map);
+  while (start < limit)
     {
-      double_table[i] = -1;
+      size_t c = start / FREE_MAP_CHUNK;
+      size_t end = (c + 1) * FREE_MAP_CHUNK < limit ? (c + 1) * FREE_MAP_CHUNK : limit;
+
+      if (chunk_free[c] > 0)
+        for (; start < end; start++)
+          if (is_free (start))
+            return start;
+      start = end;
     }
-    bitmap_write(free_map, free_map_file);
-    buffer_write(double_indirect, double_table, 0, DISK_SECTOR_SIZE);
-    free(single);
-    free(double_table);
-    return true;
-  }
-  return false;
+  return BITMAP_ERROR;
 }
 
-bool
-free_map_reallocate(size_t cnt, struct inode_disk * disk_inode)
+/* Returns the first free sector at or after START, or
+   BITMAP_ERROR if there is none. */
+static size_t
+next_free (size_t start)
 {
-  int i,j;
-  disk_sector_t target;
-  disk_sector_t single_indirect;
-  disk_sector_t double_indirect;
-  disk_sector_t * zeros = malloc(DISK_SECTOR_SIZE);
-  if(zeros == NULL)
-    return false;
-  disk_sector_t unused = -1;
-  memset(zeros,0,DISK_SECTOR_SIZE);
+  return next_free_before (start, bitmap_size (free_map));
+}
 
-  lock_acquire(&free_map_lock);
-  if(cnt<=DIRECT_NUM)
-  {
-    for(i=0; i<DIRECT_NUM; i++)
+/* Returns the number of free sectors in allocation group G. */
+static size_t
+group_free (size_t g)
+{
+  size_t c = g * (FREE_MAP_GROUP / FREE_MAP_CHUNK);
+  size_t end = c + FREE_MAP_GROUP / FREE_MAP_CHUNK;
+  size_t cnt = 0;
+
+  for (; c < end && c < chunk_cnt; c++)
+    cnt += chunk_free[c];
+  return cnt;
+}
+
+/* Returns the allocation group with the most free sectors, the
+   first of them on a tie. */
+static size_t
+emptiest_group (void)
+{
+  size_t group_cnt = DIV_ROUND_UP (bitmap_size (free_map), FREE_MAP_GROUP);
+  size_t best = 0;
+  size_t best_free = 0;
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
     {
-      if(i<=cnt-1)
-      {
-        if(disk_inode->direct[i] == -1)
+      size_t cnt = group_free (g);
+      if (cnt > best_free)
         {
-          disk_inode->direct[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-          buffer_write(disk_inode->direct[i], zeros, 0, DISK_SECTOR_SIZE);          
+          best = g;
+          best_free = cnt;
         }
-      }
     }
-    bitmap_write(free_map, free_map_file);
-    free(zeros);
-    lock_release(&free_map_lock);
-    return true;
-  }
-  else if(cnt <= (DIRECT_NUM + DISK_SECTOR_SIZE/4))
-  {
-    for(i=0; i< DIRECT_NUM; i++)
+  return best;
+}
+
+/* Returns the end of the run of free sectors from START, looking
+   no further than LIMIT. */
+static size_t
+run_end (size_t start, size_t limit)
+{
+  if (limit > bitmap_size (free_map))
+    limit = bitmap_size (free_map);
+  while (start < limit)
     {
-      if(disk_inode->direct[i] == -1)
-      {
-        disk_inode->direct[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-        buffer_write(disk_inode->direct[i], zeros, 0, DISK_SECTOR_SIZE);
-      }
+      size_t c = start / FREE_MAP_CHUNK;
+      if (start % FREE_MAP_CHUNK == 0 && chunk_free[c] == FREE_MAP_CHUNK)
+        start += FREE_MAP_CHUNK;
+      else if (is_free (start))
+        start++;
+      else
+        return start;
     }
-    
+  return limit;
+}
 
-    if(disk_inode->single_indirect == -1) // we have to allocate new single_indirect inode.
-    {
-      single_indirect = bitmap_scan_and_flip(free_map, 0, 1, false);
-      disk_inode->single_indirect = single_indirect;
-      disk_sector_t * single = malloc(DISK_SECTOR_SIZE);
+/* Returns the first sector of the first run of CNT free sectors
+   at or after START, wrapping around to the start of the disk,
+   or BITMAP_ERROR if there is no such run. */
+static size_t
+find_run (size_t start, size_t cnt)
+{
+  size_t sector = start;
+  bool wrapped = false;
 
-      for(i=0; i<DISK_SECTOR_SIZE/4; i++)
-      {
-        if(i< cnt - DIRECT_NUM )
-        {
-          target = bitmap_scan_and_flip(free_map, 0, 1, false);
-          single[i] = target;
-          buffer_write(target, zeros, 0, DISK_SECTOR_SIZE);
-        }
-        else
-          single[i] = -1;
-      }
-      bitmap_write(free_map, free_map_file);
-      buffer_write(single_indirect, single, 0, DISK_SECTOR_SIZE);
-      free(single);
-      free(zeros);
-      lock_release(&free_map_lock);
-      return true;
-    }
-    else // when there's already single table.
+  for (;;)
     {
-      single_indirect = disk_inode->single_indirect;
-      disk_sector_t * single = malloc(DISK_SECTOR_SIZE);
-      buffer_read(single_indirect, single, 0, DISK_SECTOR_SIZE);
+      size_t end;
 
-      for(i=0; i<DISK_SECTOR_SIZE/4; i++)
-      {
-        if(i<=cnt - DIRECT_NUM -1)
+      sector = next_free (sector);
+      if (sector == BITMAP_ERROR || (wrapped && sector >= start))
         {
-          if(single[i] == -1)
-          {
-            single[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-            buffer_write(single[i], zeros, 0, DISK_SECTOR_SIZE);
-          }
+          if (wrapped || start == 0)
+            return BITMAP_ERROR;
+          wrapped = true;
+          sector = 0;
+          continue;
         }
-      }
-      bitmap_write(free_map, free_map_file);
-      buffer_write(single_indirect, single, 0, DISK_SECTOR_SIZE);
-      free(single);
-      free(zeros);
-      lock_release(&free_map_lock);
-      return true;
+      end = run_end (sector, sector + cnt);
+      if (end - sector == cnt)
+        return sector;
+      sector = end;
     }
-  }
-  else // 
-  {
-    size_t new_cnt = cnt - (DIRECT_NUM + DISK_SECTOR_SIZE/4); // cnt - (122 + 128), always new_cnt >= 1.
-    size_t double_entry_num = DIV_ROUND_UP(new_cnt, (128 * 128));
-    size_t single_entry_num = new_cnt % (128 * 128);
+}
 
-    if(disk_inode->double_indirect == -1) // we have to newly allocate new double_indirect sector
+/* Finds up to CNT consecutive free sectors near HINT and stores
+   the first into *SECTORP.  Takes the free sectors from HINT on
+   if there are any, otherwise the next run of CNT free sectors
+   after HINT, otherwise as many as are free from the cursor on.
+   The caller marks or reserves them.
+   Returns the number of sectors found, 0 if the disk is full. */
+static size_t
+find_alloc (disk_sector_t hint, size_t cnt, disk_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start;
+  size_t n = 0;
+
+  ASSERT (cnt > 0);
+  if (hint < size && is_free (hint))
+    start = hint;
+  else
     {
-      double_indirect = bitmap_scan_and_flip(free_map, 0, 1, false);
-      disk_inode->double_indirect= double_indirect;
-      
-      disk_sector_t * double_table = malloc(DISK_SECTOR_SIZE);
-      disk_sector_t * single_table = malloc(DISK_SECTOR_SIZE);
-      for(i=0; i< double_entry_num; i++)
-      {
-        double_table[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-        if(i!=double_entry_num-1)  // fully allocate single_indirect
-        {
-          for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-          {
-            single_table[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-          }
-          buffer_write(double_table[i], single_table, 0, DISK_SECTOR_SIZE);
-        }
-        else
-        {
-          for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-          {
-            if(j<single_entry_num)
-            {
-              single_table[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-            }
-            else
-            {
-              single_table[i] = -1;
-            }
-          }
-          buffer_write(double_table[i], single_table, 0, DISK_SECTOR_SIZE);
-        }
-      }
-      for(i=double_entry_num; i<DISK_SECTOR_SIZE/4; i++)
-      {
-        double_table[i] = -1;
-      }
-      bitmap_write(free_map, free_map_file);
-      buffer_write(double_indirect, double_table, 0, DISK_SECTOR_SIZE);
-      free(single_table);
-      free(double_table);
-      return true;
+      start = find_run (hint < size ? hint : cursor, cnt);
+      if (start == BITMAP_ERROR)
+        start = next_free (cursor);
+      if (start == BITMAP_ERROR)
+        start = next_free (0);
     }
-    else // when there's already double table
+  if (start != BITMAP_ERROR)
     {
-      double_indirect = disk_inode->double_indirect;
-      disk_sector_t * double_table = malloc(DISK_SECTOR_SIZE);
-      disk_sector_t * single_table = malloc(DISK_SECTOR_SIZE);
-      disk_sector_t first_not_full = -5;
+      n = run_end (start, start + cnt) - start;
+      cursor = start + n;
+      *sectorp = start;
+    }
+  return n;
+}
+
+/* Allocates up to CNT consecutive sectors near HINT and stores
+   the first into *SECTORP.  See find_alloc().
+   Returns the number of sectors allocated, 0 if the disk is
+   full. */
+static size_t
+alloc_run (disk_sector_t hint, size_t cnt, disk_sector_t *sectorp)
+{
+  size_t n = find_alloc (hint, cnt, sectorp);
 
-      buffer_read(double_indirect, double_table, 0, DISK_SECTOR_SIZE);
+  if (n > 0)
+    mark (*sectorp, n, true);
+  return n;
+}
 
-      for(i=0; i<double_entry_num; i++)
-      {
-        if(double_table[i] == -1 && i != 0)
-        {
-          first_not_full = i-1;
-          break;
-        }
-      }
+/* Allocates the next free sector from the cursor on, wrapping
+   around, and returns it, or BITMAP_ERROR if the disk is full. */
+static disk_sector_t
+take_sector (void)
+{
+  size_t sector = next_free (cursor);
+
+  if (sector == BITMAP_ERROR)
+    sector = next_free (0);
+  if (sector == BITMAP_ERROR)
+    return BITMAP_ERROR;
+  mark (sector, 1, true);
+  cursor = sector + 1;
+  return sector;
+}
 
-      if(first_not_full != -5) // we have to first not fully allocated double entry and fully allocate it.
-      {
-        buffer_read(first_not_full, single_table, 0, DISK_SECTOR_SIZE);
-        for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-        {
-          if(single_table[j] == -1)
-          {
-            single_table[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-          }
-        }
-        buffer_write(first_not_full, single_table, 0, DISK_SECTOR_SIZE);
-      }
+/* Initializes the free map. */
+void
+free_map_init (void) 
+{
+  lock_init(&free_map_lock);
+  free_map = bitmap_create (disk_size (filesys_disk));
+  if (free_map == NULL)
+    PANIC ("bitmap creation failed--disk is too large");
+  chunk_cnt = DIV_ROUND_UP (bitmap_size (free_map), FREE_MAP_CHUNK);
+  chunk_free = malloc (chunk_cnt * sizeof *chunk_free);
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                DISK_SECTOR_SIZE));
+  free_map_reserved = bitmap_create (bitmap_size (free_map));
+  free_map_freed = bitmap_create (bitmap_size (free_map));
+  free_map_committing = bitmap_create (bitmap_size (free_map));
+  if (chunk_free == NULL || free_map_dirty == NULL
+      || free_map_reserved == NULL || free_map_freed == NULL
+      || free_map_committing == NULL)
+    PANIC ("free map summary creation failed");
+  bitmap_mark (free_map, FREE_MAP_SECTOR);
+  bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  summary_build ();
+}
 
-      for(i=0; i<DISK_SECTOR_SIZE/4; i++) // initialize single table again
-        single_table[i] = -1; 
+bool
+free_map_allocate_one(disk_sector_t * sectorp)
+{
+  lock_acquire(&free_map_lock);
+  disk_sector_t sector = take_sector();
+//  printf("in allocate_one, sector is %d\n", sector);
+  if(sector != BITMAP_ERROR)
+    *sectorp = sector;
+  lock_release(&free_map_lock);
+  return sector != BITMAP_ERROR;
+}
 
-      for(i=0; i<double_entry_num; i++)
-      {
+/* Allocates a sector for the inode of a new file, or a new
+   directory if IS_DIR, in directory PARENT, and stores it into
+   *SECTORP.  A directory goes to the start of the allocation
+   group with the most free space; a file goes after PARENT in
+   PARENT's group when there is room there.
+   Returns true if successful, false if the disk is full. */
+bool
+free_map_allocate_inode(disk_sector_t parent, bool is_dir, disk_sector_t * sectorp)
+{
+  size_t sector = BITMAP_ERROR;
 
-        if(double_table[i] == -1) // newly allocate double_table entry
-        {
-          double_table[i] = bitmap_scan_and_flip(free_map, 0, 1, false);
-
-          if(i!=double_entry_num-1)
-          {
-            for(j=0; j<DISK_SECTOR_SIZE/4; j++)
-            {
-              if(single_table[j]==-1)
-              {
-                single_table[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-              }
-            }
-          }
-          else // in case of last double_entry. it can be not fully allocated.
-          {
-            for(j=0; j<single_entry_num; j++)
-            {
-              single_table[j] = bitmap_scan_and_flip(free_map, 0, 1, false);
-            }
-            for(j=single_entry_num; j<DISK_SECTOR_SIZE/4; j++)
-            {
-              single_table[j] = -1;
-            }
-          }
-          buffer_write(double_table[i], single_table, 0, DISK_SECTOR_SIZE);
-        }
-      }
-      bitmap_write(free_map, free_map_file);
-      buffer_write(double_indirect, double_table, 0, DISK_SECTOR_SIZE);
-      free(single_table);
-      free(double_table);
-      return true;
-    }
+  lock_acquire(&free_map_lock);
+  if(is_dir)
+  {
+    size_t group = emptiest_group() * FREE_MAP_GROUP;
+    sector = next_free_before(group, group + FREE_MAP_GROUP);
+  }
+  else if(parent < bitmap_size(free_map))
+  {
+    size_t group = parent / FREE_MAP_GROUP * FREE_MAP_GROUP;
+    sector = next_free_before(parent, group + FREE_MAP_GROUP);
+    if(sector == BITMAP_ERROR)
+      sector = next_free_before(group, parent);
+  }
+  if(sector == BITMAP_ERROR)
+    sector = next_free(cursor);
+  if(sector == BITMAP_ERROR)
+    sector = next_free(0);
+  if(sector != BITMAP_ERROR)
+  {
+    mark(sector, 1, true);
+    *sectorp = sector;
   }
-  return false;
+  lock_release(&free_map_lock);
+  return sector != BITMAP_ERROR;
+}
+
+/* Allocates up to CNT consecutive sectors and stores the first
+   into *SECTORP, for an extent inode that wants its blocks near
+   HINT.  See alloc_run().
+   Returns the number of sectors allocated, 0 if the disk is
+   full. */
+size_t
+free_map_allocate_run(disk_sector_t hint, size_t cnt, disk_sector_t * sectorp)
+{
+  size_t n;
+
+  lock_acquire(&free_map_lock);
+  n = alloc_run(hint, cnt, sectorp);
+  lock_release(&free_map_lock);
+  return n;
 }
 
+/* Allocates up to CNT consecutive sectors for a file that wants
+   its blocks near HINT, taking them from window W first, and
+   stores the first into *SECTORP.  An empty window is refilled
+   with up to CNT or FREE_MAP_WINDOW sectors, whichever is more,
+   so that the file's next few allocations continue this one.
+   The window only reserves its sectors; they are marked in the
+   free map as they are handed out.
+   Returns the number of sectors allocated, 0 if the disk is
+   full. */
+size_t
+free_map_window_take(struct free_map_window * w, disk_sector_t hint,
+                     size_t cnt, disk_sector_t * sectorp)
+{
+  size_t n;
+
+  lock_acquire(&free_map_lock);
+  if(w->cnt == 0)
+  {
+    w->cnt = find_alloc(hint, cnt > FREE_MAP_WINDOW ? cnt : FREE_MAP_WINDOW,
+                        &w->start);
+    if(w->cnt > 0)
+      reserve(w->start, w->cnt, true);
+  }
+  n = cnt < w->cnt ? cnt : w->cnt;
+  if(n > 0)
+  {
+    reserve(w->start, n, false);
+    mark(w->start, n, true);
+  }
+  *sectorp = w->start;
+  w->start += n;
+  w->cnt -= n;
+  lock_release(&free_map_lock);
+  return n;
+}
 
+/* Releases the sectors left in window W. */
+void
+free_map_window_release(struct free_map_window * w)
+{
+  if(w->cnt > 0)
+  {
+    lock_acquire(&free_map_lock);
+    ASSERT(bitmap_all(free_map_reserved, w->start, w->cnt));
+    reserve(w->start, w->cnt, false);
+    lock_release(&free_map_lock);
+  }
+  w->cnt = 0;
+}
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use.  Under
+   the journal, they only become available once the transaction
+   that frees them has committed. */
 void
 free_map_release (disk_sector_t sector, size_t cnt)
 {
   ASSERT (bitmap_all (free_map, sector, cnt));
   lock_acquire(&free_map_lock);
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark (sector, cnt, false);
+  if (journal_is_metadata (FSSTAT_FREEMAP))
+    {
+      reserve (sector, cnt, true);
+      bitmap_set_multiple (free_map_freed, sector, cnt, true);
+    }
   lock_release(&free_map_lock);
 }
 
+/* Calls FUNC on each run of set bits in B. */
+static void
+for_each_run (const struct bitmap *b, void (*func) (size_t, size_t))
+{
+  size_t size = bitmap_size (b);
+  size_t start = 0;
+
+  while ((start = bitmap_scan (b, start, 1, true)) != BITMAP_ERROR)
+    {
+      size_t end = start + 1;
+      while (end < size && bitmap_test (b, end))
+        end++;
+      func (start, end - start);
+      start = end;
+    }
+}
+
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void) 
@@ -425,22 +489,104 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  summary_build ();
+  bitmap_set_all (free_map_dirty, false);
+}
+
+/* Writes the CNT sectors of the free map file from START, which
+   have changed. */
+static void
+flush_run (size_t start, size_t cnt)
+{
+  bitmap_write_range (free_map, free_map_file, start * DISK_SECTOR_SIZE,
+                      cnt * DISK_SECTOR_SIZE);
+  bitmap_set_multiple (free_map_dirty, start, cnt, false);
+}
+
+/* Writes the parts of the free map that have changed since they
+   were last written to the free map file, in as few writes as
+   runs of changed sectors allow. */
+void
+free_map_flush (void)
+{
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for_each_run (free_map_dirty, flush_run);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the free map's changes for a commit, like
+   free_map_flush(), and hands the sectors freed since the last
+   commit over to it, all at once so that no free can fall in
+   between.  Then calls REVOKE on each run of them.  They stay
+   reserved until free_map_commit_done(), which must come before
+   the next call.  Only the thread committing may call this. */
+void
+free_map_commit_take (void (*revoke) (size_t, size_t))
+{
+  struct bitmap *empty = free_map_committing;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for_each_run (free_map_dirty, flush_run);
+  free_map_committing = free_map_freed;
+  free_map_freed = empty;
+  lock_release (&free_map_lock);
+
+  for_each_run (free_map_committing, revoke);
+}
+
+/* Returns true if sectors freed since the last commit are being
+   held back. */
+bool
+free_map_has_freed (void)
+{
+  bool freed;
+
+  lock_acquire (&free_map_lock);
+  freed = bitmap_scan (free_map_freed, 0, 1, true) != BITMAP_ERROR;
+  lock_release (&free_map_lock);
+  return freed;
+}
+
+/* Returns the CNT sectors from START, whose free has committed,
+   to the pool. */
+static void
+unreserve_run (size_t start, size_t cnt)
+{
+  reserve (start, cnt, false);
+}
+
+/* Makes the sectors handed over by free_map_commit_take()
+   available, once the commit has been written. */
+void
+free_map_commit_done (void)
+{
+  lock_acquire (&free_map_lock);
+  for_each_run (free_map_committing, unreserve_run);
+  bitmap_set_all (free_map_committing, false);
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
-   it. */
+   it.  The file's inode keeps JOURNAL, the first sector of the
+   journal or -1 if there is none, in its parent field. */
 void
-free_map_create (void) 
+free_map_create (disk_sector_t journal) 
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false, -1)) // false means creating file.
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false, journal)) // false means creating file.
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
@@ -449,4 +595,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (free_map_dirty, false);
 }
@@ -6,18 +6,38 @@
 #include "devices/disk.h"
 #include "threads/synch.h"
 
+struct inode_disk;
+
+/* Sectors reserved for a growing file beyond what it has asked for,
+   so that its next allocations continue where the last one ended.
+   Held in memory only and released when the file is closed. */
+struct free_map_window
+{
+  disk_sector_t start;                  /* First reserved sector. */
+  size_t cnt;                           /* Sectors reserved; 0 if none. */
+};
+
+#define FREE_MAP_WINDOW 16              /* Sectors reserved at a time. */
+
 struct lock free_map_lock;
 
 void free_map_init (void);
 void free_map_read (void);
-void free_map_create (void);
+void free_map_create (disk_sector_t journal);
 void free_map_open (void);
 void free_map_close (void);
+void free_map_flush (void);
+void free_map_commit_take (void (*) (size_t, size_t));
+void free_map_commit_done (void);
+bool free_map_has_freed (void);
 
 bool free_map_allocate_one(disk_sector_t *);
 //bool free_map_allocate (size_t, disk_sector_t *);
-bool free_map_reallocate(size_t, struct inode_disk *);
-bool free_map_allocate(size_t, struct inode_disk *);
+bool free_map_allocate_inode(disk_sector_t, bool, disk_sector_t *);
+size_t free_map_allocate_run(disk_sector_t, size_t, disk_sector_t *);
+size_t free_map_window_take(struct free_map_window *, disk_sector_t, size_t,
+                            disk_sector_t *);
+void free_map_window_release(struct free_map_window *);
 void free_map_release (disk_sector_t, size_t);
 
 #endif /* filesys/free-map.h */
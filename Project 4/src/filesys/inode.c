@@ -2,7 +2,10 @@
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include "filesys/extent.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
@@ -10,6 +13,21 @@
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45   /* ...in INODE_EXTENTS format. */
+#define INODE_INLINE_MAGIC 0x494e4f49   /* ...holding its data inline. */
+
+/* Open inode table. */
+#define INODE_HASH_SIZE 64              /* Buckets in inode_table. */
+#define INODE_CLOSED_MAX 32             /* Closed inodes kept in memory. */
+
+/* Indexed block map: entries in an indirect table, and blocks
+   that the direct, indirect and doubly indirect entries map. */
+#define INDIRECT_NUM (DISK_SECTOR_SIZE / (int) sizeof (disk_sector_t))
+#define INDEXED_BLOCKS (DIRECT_NUM + INDIRECT_NUM + INDIRECT_NUM * INDIRECT_NUM)
+
+/* Read-ahead window bounds, in sectors. */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
 
 //int bounce[128];
 
@@ -48,14 +66,91 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    /* Guarded by inode_table_lock. */
+    struct list_elem elem;              /* Element in an inode_table bucket. */
+    struct list_elem lru_elem;          /* Element in closed_inodes if closed. */
     disk_sector_t sector;               /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    bool loading;                       /* DATA is still being read. */
+
+    /* Held for reading to read the data, for writing to write or
+       grow it.  Guards DATA and the preallocation window. */
+    struct rwlock rw;
     struct inode_disk data;             /* Inode content. */
+
+    /* Serializes the directory operations in directory.c, which
+       read and then change a directory's entries. */
+    struct lock dir_lock;
+    void *dir_hint;                     /* See inode_dir_hint().  Guarded
+                                           by dir_lock. */
+
+    /* Sequential read detection.  Guarded by map_lock. */
+    off_t ra_next;                      /* Where a sequential read would start. */
+    off_t ra_queued;                    /* Read-ahead has been queued up to here. */
+    int ra_window;                      /* Sectors to keep ahead of the reader. */
+
+    /* Block map cache: copies of the indirect tables, each read on
+       first use and dropped by inode_map_drop() when the inode
+       grows.  Only the most recently used table under the doubly
+       indirect block is kept. */
+    struct lock map_lock;               /* Guards the fields below. */
+    disk_sector_t *map_single;          /* Single indirect table, or null. */
+    disk_sector_t *map_double;          /* Doubly indirect table, or null. */
+    disk_sector_t *map_second;          /* A table it points to, or null. */
+    int map_second_idx;                 /* Index of that table in map_double. */
+    struct extent map_extent;           /* Extent or hole last looked up,
+                                           if cnt > 0. */
+
+    struct free_map_window prealloc;    /* Sectors reserved for growth. */
   };
 
+/* Format of the inodes that inode_create() makes. */
+static enum inode_format inode_format = INODE_INDEXED;
+
+/* Returns true if DISK_INODE maps its blocks with extents. */
+static inline bool
+is_extent(const struct inode_disk * disk_inode)
+{
+  return disk_inode->magic == INODE_EXTENT_MAGIC;
+}
+
+/* Returns true if DISK_INODE holds its data inline. */
+static inline bool
+is_inline(const struct inode_disk * disk_inode)
+{
+  return disk_inode->magic == INODE_INLINE_MAGIC;
+}
+
+/* Inode statistics.  Only the inode fields are used here; the
+   rest belong to the buffer cache. */
+static struct fsstat inode_stats;
+
+/* An indirect table with every entry a hole. */
+static disk_sector_t no_blocks[INDIRECT_NUM];
+
+/* A block of zeros. */
+static char zeros[DISK_SECTOR_SIZE];
+
+/* Returns the class under which the buffer cache counts the data
+   blocks of DISK_INODE, which is in SECTOR. */
+static enum fsstat_class
+disk_class(disk_sector_t sector, const struct inode_disk * disk_inode)
+{
+  if(sector == FREE_MAP_SECTOR)
+    return FSSTAT_FREEMAP;
+  return disk_inode->type == INODE_DIR ? FSSTAT_DIR : FSSTAT_DATA;
+}
+
+/* Returns the class under which the buffer cache counts INODE's
+   data blocks. */
+static enum fsstat_class
+inode_class(const struct inode * inode)
+{
+  return disk_class(inode->sector, &inode->data);
+}
+
 /* Returns the disk sector that contains byte offset POS within
    INODE.
    Returns -1 if INODE does not contain data for a byte at offset
@@ -73,60 +168,429 @@ byte_to_sector (const struct inode *inode, off_t pos)
 }
 */
 
+/* Returns entry IDX of the indirect table in SECTOR, read from
+   the buffer cache.  A SECTOR of -1 is a table that was never
+   needed, all holes. */
 static disk_sector_t
-byte_to_sector(const struct inode * inode, off_t pos)
+table_entry(disk_sector_t sector, int idx)
 {
+  struct buffcache_elem * table;
+  disk_sector_t result;
+
+  if(sector == (disk_sector_t) -1)
+    return -1;
+  table = buffer_get(sector, false, FSSTAT_INDIRECT);
+  result = ((disk_sector_t *) table->data)[idx];
+  buffer_put(table, false);
+  return result;
+}
+
+/* Returns entry IDX of the indirect table in SECTOR, as
+   table_entry() does, but looking it up in the copy at *COPY.
+   If *COPY is null, the table is read into a new copy first; if
+   memory for that runs out, the entry is taken from the buffer
+   cache instead. */
+static disk_sector_t
+map_lookup(disk_sector_t ** copy, disk_sector_t sector, int idx)
+{
+  if(sector == (disk_sector_t) -1)
+    return -1;
+  if(*copy == NULL)
+  {
+    *copy = malloc(DISK_SECTOR_SIZE);
+    if(*copy != NULL)
+      buffer_read(sector, *copy, 0, DISK_SECTOR_SIZE, FSSTAT_INDIRECT);
+  }
+  if(*copy != NULL)
+    return (*copy)[idx];
+  return table_entry(sector, idx);
+}
+
+/* Drops INODE's copies of its indirect tables, which must be done
+   whenever the tables change. */
+static void
+inode_map_drop(struct inode * inode)
+{
+  lock_acquire(&inode->map_lock);
+  free(inode->map_single);
+  free(inode->map_double);
+  free(inode->map_second);
+  inode->map_single = inode->map_double = inode->map_second = NULL;
+  inode->map_extent.cnt = 0;
+  lock_release(&inode->map_lock);
+}
+
+/* Returns the disk sector that contains byte offset POS within
+   INODE, or -1 if POS is in a hole. */
+static disk_sector_t
+byte_to_sector(const struct inode * inode_, off_t pos)
+{
+  struct inode * inode = (struct inode *) inode_;
+  disk_sector_t result;
+
+  if(is_extent(&inode->data))
+  {
+    size_t block = pos / DISK_SECTOR_SIZE;
+    struct extent * e = &inode->map_extent;
+
+    lock_acquire(&inode->map_lock);
+    if(e->cnt == 0 || block < e->block || block >= e->block + e->cnt)
+      extent_lookup(&inode->data, block, e);
+    if(e->start == (disk_sector_t) -1)
+      result = -1;
+    else
+      result = e->start + (block - e->block);
+    lock_release(&inode->map_lock);
+    return result;
+  }
+
+  if(pos >= INDEXED_BLOCKS * DISK_SECTOR_SIZE)
+    return -1;
   if(pos < SINGLE_INDIRECT_START)
   {
-    int result = inode->data.direct[pos / DISK_SECTOR_SIZE];
+    result = inode->data.direct[pos / DISK_SECTOR_SIZE];
 //    printf("byte sector pos is %d result is %d\n",pos, result);
     return result;
   }
-  else if(pos < DOUBLE_INDIRECT_START)
-  {
-//    printf("single_indirect case in byte_to_sector, pos is %d\n", pos);
-    disk_sector_t * single_table = malloc(DISK_SECTOR_SIZE);
-    //printf("inode->data.single_indirect = %d\n", inode->data.single_indirect);
-    buffer_read(inode->data.single_indirect, single_table, 0, DISK_SECTOR_SIZE); // what if single_indirect is NULL or something?
-    
-//    printf("single_table[0] is %d\n", single_table[0]);
 
+  lock_acquire(&inode->map_lock);
+  if(pos < DOUBLE_INDIRECT_START)
+  {
     off_t single_pos = pos - SINGLE_INDIRECT_START;
-    int index = single_pos / DISK_SECTOR_SIZE;
-    //printf("index is %d\n", index);
-    disk_sector_t result = single_table[index];
-    free(single_table);
-    return result;
+
+    result = map_lookup(&inode->map_single, inode->data.single_indirect,
+                        single_pos / DISK_SECTOR_SIZE);
   }
   else // double_indirect case
   {
-    disk_sector_t * double_table = malloc(DISK_SECTOR_SIZE);
-    disk_sector_t * single_table = malloc(DISK_SECTOR_SIZE);
-
-    buffer_read(inode->data.double_indirect, double_table, 0, DISK_SECTOR_SIZE);
-    
     off_t double_pos = pos - DOUBLE_INDIRECT_START;
     off_t single_pos = double_pos % (512 * 128);
-    disk_sector_t first_sector = double_table[double_pos / (512 * 128)];
-    buffer_read(first_sector, single_table, 0, DISK_SECTOR_SIZE);
-    disk_sector_t second_sector = single_table[single_pos / DISK_SECTOR_SIZE];
-    free(double_table);
-    free(single_table);
-    return second_sector;
+    int first_idx = double_pos / (512 * 128);
+    disk_sector_t first_sector;
+
+    first_sector = map_lookup(&inode->map_double, inode->data.double_indirect,
+                              first_idx);
+    if(inode->map_second != NULL && inode->map_second_idx != first_idx)
+    {
+      free(inode->map_second);
+      inode->map_second = NULL;
+    }
+    inode->map_second_idx = first_idx;
+    result = map_lookup(&inode->map_second, first_sector,
+                        single_pos / DISK_SECTOR_SIZE);
   }
-  printf("this shouldn't be appear\n");
+  lock_release(&inode->map_lock);
+  return result;
 }
 
+/* Table of in-memory inodes, bucketed by sector, so that opening
+   a single inode twice returns the same `struct inode'.  Besides
+   the open inodes it holds up to INODE_CLOSED_MAX that have been
+   closed but not removed, kept on closed_inodes with the most
+   recently closed at the front, so that opening one of them
+   again needs no disk access. */
+static struct list inode_table[INODE_HASH_SIZE];
+static struct list closed_inodes;
+static int closed_cnt;
+static struct lock inode_table_lock;    /* Guards the table and list. */
+static struct condition inode_loaded;   /* Signaled when an inode's DATA
+                                           has been read. */
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns the inode_table bucket for SECTOR. */
+static struct list *
+inode_bucket(disk_sector_t sector)
+{
+  return &inode_table[sector % INODE_HASH_SIZE];
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  int i;
+
+  for (i = 0; i < INODE_HASH_SIZE; i++)
+    list_init (&inode_table[i]);
+  list_init (&closed_inodes);
+  closed_cnt = 0;
+  lock_init (&inode_table_lock);
+  cond_init (&inode_loaded);
+  memset (no_blocks, 0xff, sizeof no_blocks);
+}
+
+/* Makes inode_create() use FORMAT for new inodes. */
+void
+inode_set_format(enum inode_format format)
+{
+  inode_format = format;
+}
+
+/* Makes inode_create() use the format of the file system on
+   disk, as told by the free map's inode, which is never inline. */
+void
+inode_mount(void)
+{
+  unsigned magic;
+
+  buffer_read(FREE_MAP_SECTOR, &magic, offsetof(struct inode_disk, magic),
+              sizeof magic, FSSTAT_INODE);
+  inode_format = magic == INODE_EXTENT_MAGIC ? INODE_EXTENTS : INODE_INDEXED;
+}
+
+/* Gives the holes among the CNT entries of block map TABLE from
+   FIRST on newly allocated blocks, filled with zeros if ZERO,
+   which the buffer cache counts under class CLS.  The blocks come
+   from window W, near *HINT, which is advanced past each block
+   mapped or passed over.
+   Returns true if successful, false if the disk runs out. */
+static bool
+fill_entries(disk_sector_t * table, size_t first, size_t cnt,
+             enum fsstat_class cls, bool zero, struct free_map_window * w,
+             disk_sector_t * hint)
+{
+  size_t i = first;
+  size_t end = first + cnt;
+
+  while(i < end)
+  {
+    disk_sector_t start;
+    size_t run, n, k;
+
+    if(table[i] != (disk_sector_t) -1)
+    {
+      *hint = table[i++] + 1;
+      continue;
+    }
+    for(run = 1; i + run < end && table[i + run] == (disk_sector_t) -1; run++)
+      continue;
+    n = free_map_window_take(w, *hint, run, &start);
+    if(n == 0)
+      return false;
+    for(k = 0; k < n; k++)
+    {
+      table[i + k] = start + k;
+      if(zero)
+        buffer_write(start + k, zeros, 0, DISK_SECTOR_SIZE, cls);
+    }
+    *hint = start + n;
+    i += n;
+  }
+  return true;
+}
+
+/* Does what fill_entries() does for the indirect table in
+   *SECTORP, first allocating the table, all holes, if *SECTORP is
+   -1. */
+static bool
+fill_table(disk_sector_t * sectorp, size_t first, size_t cnt,
+           enum fsstat_class cls, bool zero, struct free_map_window * w,
+           disk_sector_t * hint)
+{
+  struct buffcache_elem * table;
+  bool success;
+
+  if(*sectorp == (disk_sector_t) -1)
+  {
+    if(free_map_window_take(w, *hint, 1, sectorp) == 0)
+    {
+      *sectorp = -1;
+      return false;
+    }
+    buffer_write(*sectorp, no_blocks, 0, DISK_SECTOR_SIZE, FSSTAT_INDIRECT);
+    *hint = *sectorp + 1;
+  }
+  table = buffer_get(*sectorp, true, FSSTAT_INDIRECT);
+  success = fill_entries((disk_sector_t *) table->data, first, cnt, cls, zero,
+                         w, hint);
+  buffer_put(table, true);
+  return success;
+}
+
+/* Returns the sector that holds block BLOCK of indexed
+   DISK_INODE, or -1 if BLOCK is in a hole. */
+static disk_sector_t
+indexed_lookup(const struct inode_disk * disk_inode, size_t block)
+{
+  disk_sector_t table;
+
+  if(block < DIRECT_NUM)
+    return disk_inode->direct[block];
+  block -= DIRECT_NUM;
+  if(block < INDIRECT_NUM)
+    table = disk_inode->single_indirect;
+  else
+  {
+    block -= INDIRECT_NUM;
+    table = table_entry(disk_inode->double_indirect, block / INDIRECT_NUM);
+    block %= INDIRECT_NUM;
+  }
+  return table_entry(table, block);
+}
+
+/* Gives the holes among the CNT blocks of indexed DISK_INODE from
+   FIRST on newly allocated blocks, filled with zeros if ZERO,
+   which the buffer cache counts under class CLS, taking them from
+   window W just after the block before FIRST, or near HINT if
+   that is a hole.
+   Returns true if successful, false if the disk runs out or the
+   blocks are past the largest indexed file, in which case the
+   blocks already added stay. */
+static bool
+indexed_fill(struct inode_disk * disk_inode, size_t first, size_t cnt,
+             enum fsstat_class cls, bool zero, struct free_map_window * w,
+             disk_sector_t hint)
+{
+  size_t end = first + cnt;
+  size_t n;
+  struct buffcache_elem * b;
+  disk_sector_t * double_table;
+  bool success = true;
+
+  if(end > INDEXED_BLOCKS)
+    return false;
+  if(first > 0)
+  {
+    disk_sector_t prev = indexed_lookup(disk_inode, first - 1);
+    if(prev != (disk_sector_t) -1)
+      hint = prev + 1;
+  }
+
+  if(first < DIRECT_NUM)
+  {
+    n = (end < DIRECT_NUM ? end : DIRECT_NUM) - first;
+    if(!fill_entries(disk_inode->direct, first, n, cls, zero, w, &hint))
+      return false;
+    first += n;
+  }
+  if(first < end && first < DIRECT_NUM + INDIRECT_NUM)
+  {
+    n = (end < DIRECT_NUM + INDIRECT_NUM ? end : DIRECT_NUM + INDIRECT_NUM)
+        - first;
+    if(!fill_table(&disk_inode->single_indirect, first - DIRECT_NUM, n, cls,
+                   zero, w, &hint))
+      return false;
+    first += n;
+  }
+  if(first == end)
+    return true;
+
+  /* Doubly indirect: fill_table() on the doubly indirect table
+     would treat its entries as data, so allocate it here. */
+  if(disk_inode->double_indirect == (disk_sector_t) -1)
+  {
+    if(free_map_window_take(w, hint, 1, &disk_inode->double_indirect) == 0)
+    {
+      disk_inode->double_indirect = -1;
+      return false;
+    }
+    buffer_write(disk_inode->double_indirect, no_blocks, 0, DISK_SECTOR_SIZE,
+                 FSSTAT_INDIRECT);
+    hint = disk_inode->double_indirect + 1;
+  }
+  b = buffer_get(disk_inode->double_indirect, true, FSSTAT_INDIRECT);
+  double_table = (disk_sector_t *) b->data;
+  while(success && first < end)
+  {
+    size_t idx = first - DIRECT_NUM - INDIRECT_NUM;
+    size_t ofs = idx % INDIRECT_NUM;
+
+    n = end - first < INDIRECT_NUM - ofs ? end - first : INDIRECT_NUM - ofs;
+    success = fill_table(&double_table[idx / INDIRECT_NUM], ofs, n, cls, zero,
+                         w, &hint);
+    first += n;
+  }
+  buffer_put(b, true);
+  return success;
+}
+
+/* Frees the blocks that the CNT entries of block map TABLE map. */
+static void
+release_entries(const disk_sector_t * table, size_t cnt)
+{
+  size_t i;
+
+  for(i = 0; i < cnt; i++)
+    if(table[i] != (disk_sector_t) -1)
+      free_map_release(table[i], 1);
+}
+
+/* Frees the indirect table in SECTOR, unless SECTOR is -1, and the
+   blocks it maps, through DEPTH more levels of tables. */
+static void
+release_table(disk_sector_t sector, int depth)
+{
+  struct buffcache_elem * b;
+  const disk_sector_t * table;
+  int i;
+
+  if(sector == (disk_sector_t) -1)
+    return;
+  b = buffer_get(sector, false, FSSTAT_INDIRECT);
+  table = (const disk_sector_t *) b->data;
+  if(depth == 0)
+    release_entries(table, INDIRECT_NUM);
+  else
+    for(i = 0; i < INDIRECT_NUM; i++)
+      release_table(table[i], depth - 1);
+  buffer_put(b, false);
+  free_map_release(sector, 1);
+}
+
+/* Frees the data blocks and indirect tables of indexed
+   DISK_INODE, leaving it with none. */
+static void
+indexed_release(struct inode_disk * disk_inode)
+{
+  release_entries(disk_inode->direct, DIRECT_NUM);
+  release_table(disk_inode->single_indirect, 0);
+  release_table(disk_inode->double_indirect, 1);
+  memcpy(disk_inode->direct, no_blocks, sizeof disk_inode->direct);
+  disk_inode->single_indirect = -1;
+  disk_inode->double_indirect = -1;
+}
+
+/* Frees the blocks of DISK_INODE and whatever maps them. */
+static void
+disk_release(struct inode_disk * disk_inode)
+{
+  if(is_extent(disk_inode))
+    extent_release(disk_inode);
+  else if(!is_inline(disk_inode))
+    indexed_release(disk_inode);
+}
+
+/* Gives DISK_INODE, which is in SECTOR and must have a zeroed
+   block map, an empty one in the file system's format. */
+static void
+disk_init_map(disk_sector_t sector, struct inode_disk * disk_inode)
+{
+  if(inode_format == INODE_EXTENTS)
+  {
+    disk_inode->magic = INODE_EXTENT_MAGIC;
+    disk_inode->extent_next = sector + 1;
+  }
+  else
+  {
+    disk_inode->magic = INODE_MAGIC;
+    memcpy(disk_inode->direct, no_blocks, sizeof disk_inode->direct);
+    disk_inode->single_indirect = -1;
+    disk_inode->double_indirect = -1;
+  }
+}
+
+/* Gives the holes among the CNT blocks of DISK_INODE, which is in
+   SECTOR, from FIRST on newly allocated blocks, filled with zeros
+   if ZERO, taking them from window W.  See indexed_fill() and
+   extent_fill(). */
+static bool
+disk_fill(disk_sector_t sector, struct inode_disk * disk_inode, size_t first,
+          size_t cnt, bool zero, struct free_map_window * w)
+{
+  enum fsstat_class cls = disk_class(sector, disk_inode);
+
+  if(is_extent(disk_inode))
+    return extent_fill(disk_inode, first, cnt, cls, zero, w);
+  return indexed_fill(disk_inode, first, cnt, cls, zero, w, sector + 1);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -192,57 +656,48 @@ inode_create(disk_sector_t sector, off_t length, bool is_directory, disk_sector_
 {
   //printf("inode_create start. sector is %d, length is %d\n", sector, length);
   struct inode_disk * disk_inode = NULL;
-  bool success = false;
+  bool success = true;
 
   ASSERT(length >= 0);
   ASSERT(sizeof * disk_inode == DISK_SECTOR_SIZE);
 
   disk_inode = calloc(1, sizeof * disk_inode);
-  if(disk_inode != NULL)
-  {
-    size_t sectors = bytes_to_sectors(length);
-    disk_inode->length = length;
-    disk_inode->magic = INODE_MAGIC;
-    disk_inode->single_indirect = -1;
-    disk_inode->double_indirect = -1;
-    disk_inode->parent = parent; // newly
+  if(disk_inode == NULL)
+    return false;
 
-    if(is_directory)
-      disk_inode->type = INODE_DIR;
-    else
-      disk_inode->type = INODE_FILE;
-    
-    if(sectors == 0)
-    {
-      int i;
-      for(i=0; i<DIRECT_NUM; i++)
-        disk_inode->direct[i] = -1;
-      buffer_write(sector, disk_inode, 0, DISK_SECTOR_SIZE);
-      free(disk_inode);
-      return true;
-    }
+  disk_inode->length = length;
+  disk_inode->parent = parent; // newly
 
-    //printf("before free_map_allocate\n");
-    if(free_map_allocate(sectors, disk_inode))
-    {
-      //printf("free_map_allocate success\n");
-      buffer_write(sector, disk_inode, 0, DISK_SECTOR_SIZE);
-      
-      if(sectors > 0)
-      {
-        static char zeros[DISK_SECTOR_SIZE];
-        size_t i;
+  if(is_directory)
+    disk_inode->type = INODE_DIR;
+  else
+    disk_inode->type = INODE_FILE;
 
-        for(i=0; i<sectors; i++)
-        {
-          //buffer_write(asdfasdfasdf); // do we need this?
-        }
-      }
-      success = true;
-    }
-    //printf("after if statement\n");
-    free(disk_inode);
+  /* Small files and directories start out inline.  The free map
+     never does, so that it always shows the file system's
+     format. */
+  if(length <= INODE_INLINE_MAX && sector != FREE_MAP_SECTOR)
+    disk_inode->magic = INODE_INLINE_MAGIC;
+  else
+    disk_init_map(sector, disk_inode);
+
+  /* A file starts out as one hole, given blocks as it is written.
+     Directories, whose entries directory.c reads straight from the
+     buffer cache, and the free map, which cannot allocate from
+     itself while it is being written, get all of theirs now. */
+  if(!is_inline(disk_inode) && (is_directory || sector == FREE_MAP_SECTOR))
+  {
+    struct free_map_window w = {0, 0};
+
+    success = disk_fill(sector, disk_inode, 0, bytes_to_sectors(length), true,
+                        &w);
+    free_map_window_release(&w);
+    if(!success)
+      disk_release(disk_inode);
   }
+  if(success)
+    buffer_write(sector, disk_inode, 0, DISK_SECTOR_SIZE, FSSTAT_INODE);
+  free(disk_inode);
   //printf("inode_create end\n");
   return success;
 }
@@ -254,17 +709,34 @@ inode_create(disk_sector_t sector, off_t length, bool is_directory, disk_sector_
 struct inode *
 inode_open (disk_sector_t sector) 
 {
+  struct list *bucket = inode_bucket (sector);
   struct list_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+  /* Check whether this inode is already open, or closed but still
+     in memory. */
+  lock_acquire (&inode_table_lock);
+  for (e = list_begin (bucket); e != list_end (bucket);
        e = list_next (e)) 
     {
       inode = list_entry (e, struct inode, elem);
       if (inode->sector == sector) 
         {
-          inode_reopen (inode);
+          if (inode->open_cnt == 0)
+            {
+              list_remove (&inode->lru_elem);
+              closed_cnt--;
+              inode->ra_next = 0;
+              inode->ra_queued = 0;
+              inode->ra_window = 0;
+              inode_stats.inode_revives++;
+            }
+          else
+            inode_stats.inode_reopens++;
+          inode->open_cnt++;
+          while (inode->loading)
+            cond_wait (&inode_loaded, &inode_table_lock);
+          lock_release (&inode_table_lock);
           return inode; 
         }
     }
@@ -274,17 +746,38 @@ inode_open (disk_sector_t sector)
   if (inode == NULL)
   {
     printf("malloc failed in inode_open\n");
+    lock_release (&inode_table_lock);
     return NULL;
   }
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  list_push_front (bucket, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->loading = true;
+  inode->ra_next = 0;
+  inode->ra_queued = 0;
+  inode->ra_window = 0;
+  rwlock_init(&inode->rw);
+  lock_init(&inode->dir_lock);
+  inode->dir_hint = NULL;
+  lock_init(&inode->map_lock);
+  inode->map_single = inode->map_double = inode->map_second = NULL;
+  inode->map_extent.cnt = 0;
+  inode->prealloc.cnt = 0;
 //  disk_read (filesys_disk, inode->sector, &inode->data);
 //  printf("in inode_open before buffer_read, sector is %d\n", sector);
-  buffer_read(inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+  inode_stats.inode_opens++;
+  lock_release (&inode_table_lock);
+
+  /* Read it without holding up opens of other inodes.  Other
+     openers of this one wait in the loop above until it is read. */
+  buffer_read(inode->sector, &inode->data, 0, DISK_SECTOR_SIZE, FSSTAT_INODE);
+  lock_acquire (&inode_table_lock);
+  inode->loading = false;
+  cond_broadcast (&inode_loaded, &inode_table_lock);
+  lock_release (&inode_table_lock);
 //  struct inode_disk * k = &inode->data;
 //  struct inode_disk * d = &buffer_cache[0].data;
 //  printf("k->start is %d k->length is %d\n", k->start, k->length);
@@ -299,7 +792,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table_lock);
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+    }
   return inode;
 }
 
@@ -315,6 +812,17 @@ inode_get_parent(struct inode * inode)
 {
   return inode->data.parent;
 }
+
+/* Frees in-memory INODE, its block map cache and its directory
+   hint. */
+static void
+inode_free(struct inode * inode)
+{
+  inode_map_drop(inode);
+  free(inode->dir_hint);
+  free(inode);
+}
+
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
@@ -348,55 +856,45 @@ inode_close (struct inode *inode)
 void
 inode_close(struct inode * inode)
 {
+  struct inode * old = NULL;
+
   //printf("inode_close called\n");
   if(inode == NULL)
     return;
-  if(--inode->open_cnt == 0)
+  lock_acquire(&inode_table_lock);
+  if(--inode->open_cnt > 0)
   {
-    //printf("open_cnt ==0\n");
+    lock_release(&inode_table_lock);
+    return;
+  }
+  //printf("open_cnt ==0\n");
+  free_map_window_release(&inode->prealloc);
+
+  if(inode->removed)
+  {
+    /* Once out of the table nobody can find it, so its blocks can
+       be freed without the lock. */
     list_remove(&inode->elem);
+    lock_release(&inode_table_lock);
+    disk_release(&inode->data);
+    free_map_release(inode->sector, 1);
+    inode_free(inode);
+    return;
+  }
 
-    if(inode->removed)
-    {
-      int i;
-      disk_sector_t target;
-      for(i=0; i<DIRECT_NUM; i++)
-      {
-        target = inode->data.direct[i];
-        if(target != -1)
-          free_map_release(target, 1);
-        else
-        {
-          free(inode);
-          return;
-        }
-      }
-      disk_sector_t single_indirect = inode->data.single_indirect;
-      if(single_indirect == -1)
-      {
-        free(inode);
-        return;
-      }
-      //free single_indirect entry
-      disk_sector_t * single_table = malloc(DISK_SECTOR_SIZE);
-      buffer_read(single_indirect, single_table, 0, DISK_SECTOR_SIZE);
-
-      for(i=0; i<DISK_SECTOR_SIZE/4; i++)
-      {
-        target = single_table[i];
-        if(target != -1)
-          free_map_release(target, 1);
-        else
-        {
-          free(single_table);
-          free(inode);
-          return;
-        }
-      }
-      free(single_table);
-      // do nothing about double_indirect
-    }
+  /* Keep it for a later open, dropping the least recently
+     closed inode if there are too many. */
+  inode_map_drop(inode);
+  list_push_front(&closed_inodes, &inode->lru_elem);
+  if(++closed_cnt > INODE_CLOSED_MAX)
+  {
+    old = list_entry(list_pop_back(&closed_inodes), struct inode, lru_elem);
+    closed_cnt--;
+    list_remove(&old->elem);
   }
+  lock_release(&inode_table_lock);
+  if(old != NULL)
+    inode_free(old);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -405,7 +903,73 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode_table_lock);
   inode->removed = true;
+  lock_release (&inode_table_lock);
+}
+
+/* Updates INODE's read-ahead window after a read of the bytes
+   between START and END, and queues background fetches for the
+   sectors that follow.  The window doubles while reads keep
+   picking up where the last one stopped and halves on a seek. */
+static void
+inode_read_ahead(struct inode * inode, off_t start, off_t end)
+{
+  off_t limit;
+  off_t pos;
+
+  lock_acquire(&inode->map_lock);
+  if(start == inode->ra_next)
+  {
+    if(inode->ra_window == 0)
+      inode->ra_window = READ_AHEAD_MIN;
+    else if(inode->ra_window < READ_AHEAD_MAX)
+      inode->ra_window *= 2;
+  }
+  else
+  {
+    inode->ra_window /= 2;
+    inode->ra_queued = 0;
+  }
+  inode->ra_next = end;
+
+  limit = end + inode->ra_window * DISK_SECTOR_SIZE;
+  if(limit > inode_length(inode))
+    limit = inode_length(inode);
+
+  /* Start with the first sector the reader has not touched. */
+  pos = ROUND_UP(end, DISK_SECTOR_SIZE);
+  if(pos < inode->ra_queued)
+    pos = inode->ra_queued;
+  if(limit > inode->ra_queued)
+    inode->ra_queued = ROUND_UP(limit, DISK_SECTOR_SIZE);
+  lock_release(&inode->map_lock);
+
+  for(; pos < limit; pos += DISK_SECTOR_SIZE)
+  {
+    disk_sector_t sector = byte_to_sector(inode, pos);
+    if(sector != (disk_sector_t) -1)
+      buffer_read_ahead(sector);
+  }
+}
+
+/* Pins the cache block that holds byte OFFSET of INODE, as
+   buffer_get() does, and returns it.  Returns a null pointer if
+   INODE has no block of its own at OFFSET: if OFFSET is past the
+   end or in a hole, or INODE holds its data inline.  Takes no
+   inode lock, so the caller must keep writers away by other
+   means, as directory.c does with inode_dir_lock(). */
+struct buffcache_elem *
+inode_get_block(const struct inode * inode, off_t offset, bool exclusive)
+{
+  disk_sector_t sector;
+
+  if(offset < 0 || offset >= inode_length(inode) || is_inline(&inode->data))
+    return NULL;
+  sector = byte_to_sector(inode, offset);
+  if(sector == (disk_sector_t) -1)
+    return NULL;
+  return buffer_get(sector, exclusive, inode_class(inode));
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -419,6 +983,20 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 //  uint8_t *bounce = NULL;
 //  printf("inode_read_at start size is %d offset is %d ", size, offset);
 
+  rwlock_acquire_read(&inode->rw);
+
+  if (is_inline (&inode->data))
+    {
+      if (offset < inode->data.length)
+        {
+          bytes_read = inode->data.length - offset;
+          if (size < bytes_read)
+            bytes_read = size;
+          memcpy (buffer, inode->data.inline_data + offset, bytes_read);
+        }
+      size = 0;
+    }
+
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -436,11 +1014,18 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
+      if (sector_idx == (disk_sector_t) -1)
+        {
+          /* A hole reads as zeros, without touching the disk. */
+          memset (buffer + bytes_read, 0, chunk_size);
+          inode_stats.hole_bytes += chunk_size;
+        }
+      else if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
         {
           /* Read full sector directly into caller's buffer. */
           //disk_read (filesys_disk, sector_idx, buffer + bytes_read);
-          buffer_read(sector_idx, buffer + bytes_read, 0, DISK_SECTOR_SIZE);
+          buffer_read(sector_idx, buffer + bytes_read, 0, DISK_SECTOR_SIZE,
+                      inode_class(inode));
         }
       else 
         {
@@ -456,7 +1041,8 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
             */
           //disk_read (filesys_disk, sector_idx, bounce);
           //memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-          buffer_read(sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
+          buffer_read(sector_idx, buffer + bytes_read, sector_ofs, chunk_size,
+                      inode_class(inode));
         }
       
       /* Advance. */
@@ -464,16 +1050,74 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+  if(bytes_read > 0 && !is_inline(&inode->data))
+    inode_read_ahead(inode, offset - bytes_read, offset);
+  rwlock_release_read(&inode->rw);
+  inode_stats.bytes_read += bytes_read;
 //  free (bounce);
   //printf("inode_read at return value is %d\n", bytes_read);
   return bytes_read;
 }
 
+/* Gives the holes among the CNT blocks of INODE from FIRST on
+   newly allocated blocks, from INODE's preallocation window, and
+   writes INODE to disk.  The new blocks are not zeroed: the
+   caller must write each of them whole, or zero it first.  The
+   caller must hold INODE's lock for writing.
+   Returns true if successful, false if the disk runs out or the
+   file would be too large, in which case the blocks already
+   added stay. */
+static bool
+inode_fill(struct inode * inode, size_t first, size_t cnt)
+{
+  bool success = disk_fill(inode->sector, &inode->data, first, cnt, false,
+                           &inode->prealloc);
+
+  inode_map_drop(inode);
+  buffer_write(inode->sector, &inode->data, 0, DISK_SECTOR_SIZE, FSSTAT_INODE);
+  return success;
+}
+
+/* Moves the data of inline INODE out into a block of its own
+   and gives INODE an empty block map in the file system's format,
+   so that it can grow past INODE_INLINE_MAX bytes.  The caller
+   must hold INODE's lock for writing.
+   Returns true if successful, false if the disk or memory runs
+   out, in which case INODE stays inline. */
+static bool
+inode_uninline(struct inode * inode)
+{
+  struct inode_disk * old = malloc(sizeof * old);
+  bool success;
+
+  if(old == NULL)
+    return false;
+  *old = inode->data;
+  memset(inode->data.inline_data, 0, sizeof inode->data.inline_data);
+  disk_init_map(inode->sector, &inode->data);
+  success = disk_fill(inode->sector, &inode->data, 0,
+                      bytes_to_sectors(old->length), true, &inode->prealloc);
+  if(!success)
+  {
+    disk_release(&inode->data);
+    inode->data = *old;
+  }
+  else if(old->length > 0)
+    buffer_write(byte_to_sector(inode, 0), old->inline_data, 0, old->length,
+                 inode_class(inode));
+  inode_map_drop(inode);
+  buffer_write(inode->sector, &inode->data, 0, DISK_SECTOR_SIZE, FSSTAT_INODE);
+  free(old);
+  return success;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk is full or an error occurs.
+   A write past end of file extends INODE.  Only the sectors
+   written get blocks; any that the write skips over stay holes.
+   Data that fits in INODE_INLINE_MAX bytes is kept in the inode
+   itself until a write goes past that. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
@@ -481,41 +1125,30 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   //printf("inode_write_at start\n");
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool fill_failed = false;
 //  int bounce[128];
 
 //  printf("inode_write_at start, size is %d, offset is %d inode->data.length is %d\n", size, offset, inode->data.length);
   //  printf("inode->data.length is %d, inode->data.start is %d, inode->sector is %d\n", inode->data.length, inode->data.start, inode->sector);
-  if(offset + size > inode->data.length) // we have to grow file
+  rwlock_acquire_write(&inode->rw);
+  if (inode->deny_write_cnt
+      || (is_inline (&inode->data) && offset + size > INODE_INLINE_MAX
+          && !inode_uninline (inode)))
   {
-    int over_offset = (offset + size);
-    int over_sector = bytes_to_sectors(offset + size);
-    int needed_sector = over_sector - bytes_to_sectors(inode->data.length);
-//    printf("needed_sector is %d\n", needed_sector);
-    
- //   uint8_t * temp = malloc(DISK_SECTOR_SIZE);
- //   memset(temp, 0, DISK_SECTOR_SIZE);
-
-  //  disk_sector_t curr = bytes_to_sectors(inode_length(inode));
-  //  buffer_read(curr, temp, 0 , DISK_SECTOR_SIZE);
-    
-
-//    printf("before free_map_reallocate, oversector is %d over_offset is %d\n", over_sector, over_offset); 
-//    printf("inode->data.single_indirect is %d\n", inode->data.single_indirect);
-    if(!free_map_reallocate(over_sector, &inode->data))
-    {
-//      free(temp);
-      return 0;
-    }
-//    printf("after free_map_reallocate\n");
-    inode->data.length = over_offset;
-    buffer_write(inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
-//    free(temp);
-//    printf("after extending size\n");
+    rwlock_release_write(&inode->rw);
+    return 0;
   }
 
-  if (inode->deny_write_cnt)
-    return 0;
+  if (is_inline (&inode->data) && size > 0)
+    {
+      memcpy (inode->data.inline_data + offset, buffer, size);
+      bytes_written = size;
+      offset += size;
+      size = 0;
+      if (offset <= inode->data.length)
+        buffer_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE,
+                      FSSTAT_INODE);
+    }
 
   while (size > 0) 
     {
@@ -524,15 +1157,42 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       disk_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % DISK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Number of bytes to actually write into this sector. */
       int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int chunk_size = size < sector_left ? size : sector_left;
+  //    printf("chunk_size is %d, sector_idx is %d, sector_ofs is %d\n", chunk_size, sector_idx, sector_ofs);
 
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-  //    printf("chunk_size is %d, sector_idx is %d inode_left is %d, sector_ofs is %d\n", chunk_size, sector_idx, inode_left , sector_ofs);
-      if (chunk_size <= 0)
+      /* Give blocks to the hole at OFFSET, and to any others
+         before the end of the write, all at once.  Only the first
+         and last blocks can be written in part; each of those
+         that is new is zeroed here, and the rest are written
+         whole below.  If the disk runs out, write as far as the
+         blocks that were added reach. */
+      if (sector_idx == (disk_sector_t) -1 && !fill_failed)
+        {
+          size_t first = offset / DISK_SECTOR_SIZE;
+          off_t end = offset + size;
+          bool last_new = (end % DISK_SECTOR_SIZE != 0
+                           && (size_t) (end - 1) / DISK_SECTOR_SIZE != first
+                           && byte_to_sector (inode, end - 1)
+                              == (disk_sector_t) -1);
+
+          fill_failed = !inode_fill (inode, first,
+                                     bytes_to_sectors (end) - first);
+          sector_idx = byte_to_sector (inode, offset);
+          if (sector_idx != (disk_sector_t) -1
+              && chunk_size < DISK_SECTOR_SIZE)
+            buffer_write (sector_idx, zeros, 0, DISK_SECTOR_SIZE,
+                          inode_class (inode));
+          if (last_new)
+            {
+              disk_sector_t last = byte_to_sector (inode, end - 1);
+              if (last != (disk_sector_t) -1)
+                buffer_write (last, zeros, 0, DISK_SECTOR_SIZE,
+                              inode_class (inode));
+            }
+        }
+      if (sector_idx == (disk_sector_t) -1)
         break;
 
       if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
@@ -540,7 +1200,8 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
           /* Write full sector directly to disk. */
           //disk_write (filesys_disk, sector_idx, buffer + bytes_written);
           //printf("in inode_write_at wringing full sector\n");
-          buffer_write(sector_idx, buffer + bytes_written, 0, DISK_SECTOR_SIZE); 
+          buffer_write(sector_idx, buffer + bytes_written, 0, DISK_SECTOR_SIZE,
+                       inode_class(inode));
         }
       else 
         {
@@ -575,7 +1236,8 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
           
           //disk_write (filesys_disk, sector_idx, bounce);
 //          printf("in inode_write_at 2nd case\n");
-          buffer_write(sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
+          buffer_write(sector_idx, buffer + bytes_written, sector_ofs, chunk_size,
+                       inode_class(inode));
           //buffer_write(sector_idx, bounce, 0, DISK_SECTOR_SIZE);
         }
 
@@ -586,6 +1248,15 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     }
   //free (bounce);
   //printf("inode_write_at end\n");
+  if (offset > inode->data.length)
+    {
+      inode->data.length = offset;
+      buffer_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE,
+                    FSSTAT_INODE);
+      inode_stats.extends++;
+    }
+  rwlock_release_write(&inode->rw);
+  inode_stats.bytes_written += bytes_written;
 
   return bytes_written;
 }
@@ -595,8 +1266,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode_table_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode_table_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -605,9 +1278,39 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inode_table_lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode_table_lock);
+}
+
+/* Acquires the lock that directory.c holds on directory INODE
+   while it reads and changes its entries. */
+void
+inode_dir_lock(struct inode * inode)
+{
+  lock_acquire(&inode->dir_lock);
+}
+
+/* Releases the lock taken by inode_dir_lock(). */
+void
+inode_dir_unlock(struct inode * inode)
+{
+  lock_release(&inode->dir_lock);
+}
+
+/* Returns SIZE bytes that directory.c keeps with directory INODE
+   for as long as INODE stays in memory, zeroed when first asked
+   for, or a null pointer if memory runs out.  The caller must hold
+   the lock taken by inode_dir_lock(), and must always ask for the
+   same SIZE. */
+void *
+inode_dir_hint(struct inode * inode, size_t size)
+{
+  if(inode->dir_hint == NULL)
+    inode->dir_hint = calloc(1, size);
+  return inode->dir_hint;
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -631,3 +1334,32 @@ inode_is_dir(struct inode * inode)
   else
     return false;
 }
+
+/* Copies the inode statistics into the matching fields of ST,
+   leaving the others alone.  Counts are not locked and may be
+   slightly off while other threads use the file system. */
+void
+inode_get_stats(struct fsstat * st)
+{
+  st->inode_opens = inode_stats.inode_opens;
+  st->inode_reopens = inode_stats.inode_reopens;
+  st->inode_revives = inode_stats.inode_revives;
+  st->bytes_read = inode_stats.bytes_read;
+  st->hole_bytes = inode_stats.hole_bytes;
+  st->bytes_written = inode_stats.bytes_written;
+  st->extends = inode_stats.extends;
+}
+
+/* Prints inode statistics. */
+void
+inode_print_stats(void)
+{
+  struct fsstat st;
+
+  inode_get_stats(&st);
+  printf("Inodes: %lld opens (%lld already open, %lld kept after close), "
+         "%lld bytes read (%lld from holes), %lld bytes written, "
+         "%lld extensions\n",
+         st.inode_opens, st.inode_reopens, st.inode_revives, st.bytes_read,
+         st.hole_bytes, st.bytes_written, st.extends);
+}
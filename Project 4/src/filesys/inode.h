@@ -2,10 +2,14 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
 
 struct bitmap;
+struct buffcache_elem;
+struct fsstat;
 
 #define DIRECT_NUM (122)
 #define SINGLE_INDIRECT_START (DISK_SECTOR_SIZE * DIRECT_NUM)
@@ -17,6 +21,33 @@ enum inode_type
   INODE_DIR,
 };
 
+/* On-disk inode formats.  A file system uses the one it was
+   formatted with for all of its inodes; each inode's magic number
+   tells which it has. */
+enum inode_format
+{
+  INODE_INDEXED,        /* Direct, indirect and doubly indirect pointers. */
+  INODE_EXTENTS,        /* Extent tree, see extent.c. */
+};
+
+/* Bytes of data that an inode can hold in its own sector, in
+   place of a block map.  Smaller files and directories are kept
+   there until they outgrow it. */
+#define INODE_INLINE_MAX 496
+
+#define EXTENT_ROOT_NUM 40      /* Extent tree entries in the inode itself. */
+
+/* Extent tree entry.  In a leaf, maps CNT file blocks from BLOCK
+   on to the sectors from START on.  In an index node, points to
+   the child node in sector START, which maps the blocks from BLOCK
+   up to the next entry's BLOCK; CNT is unused. */
+struct extent
+{
+  uint32_t block;
+  disk_sector_t start;
+  uint32_t cnt;
+};
+
 struct inode_disk
 {
   off_t length;
@@ -24,13 +55,30 @@ struct inode_disk
   unsigned magic;
 //  unsigned unused;
   disk_sector_t parent;
-  disk_sector_t direct[122];
-  disk_sector_t single_indirect;
-  disk_sector_t double_indirect;
+  union
+  {
+    struct                              /* INODE_INDEXED. */
+    {
+      disk_sector_t direct[122];
+      disk_sector_t single_indirect;
+      disk_sector_t double_indirect;
+    };
+    struct                              /* INODE_EXTENTS. */
+    {
+      uint32_t extent_cnt;              /* Entries used in extents[]. */
+      uint32_t extent_depth;            /* Index levels above the leaves. */
+      uint32_t extent_blocks;           /* File blocks mapped. */
+      disk_sector_t extent_next;        /* Sector after the last one mapped. */
+      struct extent extents[EXTENT_ROOT_NUM];
+    };
+    uint8_t inline_data[INODE_INLINE_MAX];  /* Inline: the data itself. */
+  };
 };
 
 
 void inode_init (void);
+void inode_set_format (enum inode_format);
+void inode_mount (void);
 //bool inode_create (disk_sector_t, off_t, bool); // original: inode_create(disk_sector_t, off_t);
 bool inode_create(disk_sector_t, off_t, bool, disk_sector_t);
 struct inode *inode_open (disk_sector_t);
@@ -41,9 +89,15 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+struct buffcache_elem *inode_get_block (const struct inode *, off_t, bool);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
 bool inode_is_removed(struct inode *); // newly added
 bool inode_is_dir(struct inode * inode); //newly added
+void inode_dir_lock(struct inode *);
+void inode_dir_unlock(struct inode *);
+void *inode_dir_hint(struct inode *, size_t);
+void inode_get_stats(struct fsstat *);
+void inode_print_stats(void);
 #endif /* filesys/inode.h */
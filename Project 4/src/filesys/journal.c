@@ -0,0 +1,1026 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Changes to metadata blocks (inodes, indirect blocks and extent
+   nodes, directories and the free map, as the buffer cache
+   classes them) are not written in place until they have been
+   logged.  The cache holds a changed metadata block in
+   JOURNAL_DIRTY state, in which it is neither written back nor
+   evicted.  Every JOURNAL_INTERVAL ticks the commit thread waits
+   for the operations in progress to finish, takes every such
+   block and writes a transaction to the log: a descriptor naming
+   the blocks' home sectors, a copy of each block, and a commit
+   block with a checksum over them all.  The blocks then go back
+   to being ordinary dirty blocks, which write-behind writes in
+   place in its own time.
+
+   The log is a ring of sectors following a header sector, which
+   names the oldest transaction that may still have a block not
+   yet in place.  A transaction leaves the log once all of its
+   blocks are in place, or have been logged again later.  If the
+   log fills up all the same, the commit thread writes every
+   logged block in place at once.
+
+   At mount, the transactions from the one the header names on
+   are replayed, up to the first one that was not committed
+   whole.
+
+   A metadata block that is freed and reused for file data would
+   be overwritten by the replay of a transaction that logged it.
+   So the transaction that commits a free also revokes each sector
+   freed that a transaction in the log logged, or that it logs
+   itself, which keeps replay from writing the copies of the
+   sector logged by that transaction or older ones.  The free map
+   keeps the sectors from being reused until it has committed.
+
+   A transaction holds whole operations, so all of it must fit in
+   the log, and its blocks in the cache until it commits.
+   journal_begin() reserves JOURNAL_CREDITS blocks for each handle
+   against both, committing first when they are short, so a
+   handle never waits for a commit once it has started.  An
+   operation that may change more blocks, such as a long write,
+   is cut into parts that each leave the file system consistent,
+   with journal_restart() between them.
+
+   File data itself is not logged, so after a crash a file may
+   hold data older or newer than its metadata says. */
+
+#define JOURNAL_MAGIC 0x4c4e524a        /* Header. */
+#define JOURNAL_DESC_MAGIC 0x4353454a   /* Descriptor block. */
+#define JOURNAL_COMMIT_MAGIC 0x4d4d434a /* Commit block. */
+
+/* Blocks named by one descriptor. */
+#define JOURNAL_TXN_MAX 125
+
+/* Set in a descriptor entry that revokes its sector instead of
+   logging it. */
+#define JOURNAL_REVOKE_BIT 0x80000000u
+
+/* Most revocations in a transaction: one for each sector logged
+   by the transactions in the log, and one for each block it logs
+   itself. */
+#define JOURNAL_REVOKE_MAX (2 * JOURNAL_SECTORS)
+
+/* Most descriptors in a transaction. */
+#define JOURNAL_DESC_MAX \
+  DIV_ROUND_UP (JOURNAL_SECTORS + JOURNAL_REVOKE_MAX, JOURNAL_TXN_MAX)
+
+/* Most transactions the log can hold, each being at least a
+   descriptor and a commit block. */
+#define JOURNAL_TXN_CNT (JOURNAL_SECTORS / 2)
+
+/* Buckets in logged_table. */
+#define LOGGED_HASH_SIZE 64
+
+/* Journal header, in the first sector of the journal.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_header
+{
+  uint32_t magic;                       /* JOURNAL_MAGIC. */
+  uint32_t sectors;                     /* Journal size, header included. */
+  uint32_t tail;                        /* Log position of the first
+                                           transaction to replay. */
+  uint32_t seq;                         /* Its sequence number. */
+  uint8_t unused[DISK_SECTOR_SIZE - 16];
+};
+
+/* First block of a transaction, followed in the log by a copy of
+   each block logged, in the order of ENTRIES, then by a struct
+   journal_commit.  Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_desc
+{
+  uint32_t magic;                       /* JOURNAL_DESC_MAGIC. */
+  uint32_t seq;                         /* Sequence number. */
+  uint32_t cnt;                         /* Entries used. */
+  disk_sector_t entries[JOURNAL_TXN_MAX];   /* Home sectors. */
+};
+
+/* Last block of a transaction.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_commit
+{
+  uint32_t magic;                       /* JOURNAL_COMMIT_MAGIC. */
+  uint32_t seq;                         /* Sequence number. */
+  uint32_t checksum;                    /* Over the blocks before it. */
+  uint8_t unused[DISK_SECTOR_SIZE - 12];
+};
+
+/* A transaction in the log. */
+struct journal_txn
+{
+  uint32_t seq;                         /* Sequence number. */
+  size_t pos;                           /* Log position of its descriptor. */
+  size_t len;                           /* Sectors it takes. */
+};
+
+/* A sector logged by a transaction still in the log. */
+struct logged_sector
+{
+  struct list_elem elem;                /* In logged_table or logged_free. */
+  disk_sector_t sector;
+  uint32_t seq;                         /* Last transaction to log it. */
+};
+
+static bool journal_on;                 /* Is there a journal in use? */
+static disk_sector_t journal_start;     /* Sector of the header. */
+
+/* The log, the sectors after the header.  Guarded by commit_lock,
+   like everything else that only commits touch. */
+static size_t log_size;                 /* Sectors in the log. */
+static size_t log_head;                 /* Where the next transaction goes. */
+static size_t log_used;                 /* Sectors the transactions take. */
+static int batch_max;                   /* Most blocks in a transaction. */
+static uint32_t next_seq;               /* Number of the next transaction. */
+static struct journal_txn txns[JOURNAL_TXN_CNT];    /* Oldest at txn_first. */
+static size_t txn_first;
+static size_t txn_cnt;
+static size_t header_tail;              /* Header as last written. */
+static uint32_t header_seq;
+static struct lock commit_lock;         /* Held by a thread committing. */
+static bool commit_soon;                /* Commit at the next nap? */
+
+/* Sectors that the transaction being committed revokes. */
+static disk_sector_t txn_revokes[JOURNAL_REVOKE_MAX];
+static size_t txn_revoke_cnt;
+
+/* Handles.  A commit waits for those running to end, and keeps new
+   ones from starting until it has taken the blocks to log.
+   Guarded by journal_lock, which is never held while acquiring
+   another lock. */
+static struct lock journal_lock;
+static int handles;                     /* Handles running. */
+static int credits;                     /* Blocks reserved for them. */
+static int committing;                  /* Blocks being logged. */
+static int room;                        /* Most blocks the cache can hold. */
+static int commit_extra;                /* Free map blocks a commit adds. */
+static bool commit_waiting;             /* Is a commit waiting on them? */
+static struct condition handles_done;   /* Signaled when HANDLES drops to 0. */
+static struct condition commit_done;    /* Signaled when COMMIT_WAITING clears. */
+
+/* Sectors logged by the transactions in the log, for
+   is_logged().  Guarded by journal_lock.  No more can be
+   logged than the log has sectors. */
+static struct list logged_table[LOGGED_HASH_SIZE];
+static struct list logged_free;
+static struct logged_sector logged_pool[JOURNAL_SECTORS];
+static size_t logged_cnt;
+
+static struct fsstat journal_stats;     /* Guarded by commit_lock. */
+
+static void journal_daemon (void *);
+
+/* Initializes the journal module.  There is no journal in use
+   until journal_create() or journal_mount() finds one. */
+void
+journal_init(void)
+{
+  int i;
+
+  ASSERT(sizeof (struct journal_header) == DISK_SECTOR_SIZE);
+  ASSERT(sizeof (struct journal_desc) == DISK_SECTOR_SIZE);
+  ASSERT(sizeof (struct journal_commit) == DISK_SECTOR_SIZE);
+
+  journal_on = false;
+  lock_init(&commit_lock);
+  lock_init(&journal_lock);
+  cond_init(&handles_done);
+  cond_init(&commit_done);
+  handles = 0;
+  credits = 0;
+  committing = 0;
+  commit_waiting = false;
+  for(i = 0; i < LOGGED_HASH_SIZE; i++)
+    list_init(&logged_table[i]);
+  list_init(&logged_free);
+  for(i = 0; i < JOURNAL_SECTORS; i++)
+    list_push_back(&logged_free, &logged_pool[i].elem);
+  logged_cnt = 0;
+}
+
+/* Returns the disk sector at log position POS. */
+static disk_sector_t
+log_sector(size_t pos)
+{
+  return journal_start + 1 + pos % log_size;
+}
+
+/* Writes the CNT sectors at BUFS to the log from position POS
+   on, in one transfer, or two if the log wraps around. */
+static void
+log_write(size_t pos, size_t cnt, const void * const * bufs)
+{
+  while(cnt > 0)
+  {
+    size_t n = log_size - pos % log_size;
+
+    if(n > cnt)
+      n = cnt;
+    if(n == 1)
+      disk_write(filesys_disk, log_sector(pos), bufs[0]);
+    else
+      disk_write_multiple(filesys_disk, log_sector(pos), n, bufs);
+    pos += n;
+    bufs += n;
+    cnt -= n;
+  }
+}
+
+/* Returns SUM updated with the sector of data at DATA. */
+static uint32_t
+checksum(uint32_t sum, const void * data)
+{
+  const uint32_t * w = data;
+  size_t i;
+
+  for(i = 0; i < DISK_SECTOR_SIZE / sizeof *w; i++)
+    sum = (sum << 1 | sum >> 31) ^ w[i];
+  return sum;
+}
+
+/* Writes the header, naming the oldest transaction in the log, or
+   the place of the next one if there is none.  Does nothing if
+   that has not changed since the last write. */
+static void
+header_update(bool force)
+{
+  static struct journal_header h;
+  size_t tail = txn_cnt > 0 ? txns[txn_first].pos : log_head;
+  uint32_t seq = txn_cnt > 0 ? txns[txn_first].seq : next_seq;
+
+  if(!force && tail == header_tail && seq == header_seq)
+    return;
+  h.magic = JOURNAL_MAGIC;
+  h.sectors = log_size + 1;
+  h.tail = tail;
+  h.seq = seq;
+  disk_write(filesys_disk, journal_start, &h);
+  header_tail = tail;
+  header_seq = seq;
+}
+
+/* Returns SECTOR's entry in logged_table, or a null pointer.
+   The caller must hold journal_lock. */
+static struct logged_sector *
+logged_find(disk_sector_t sector)
+{
+  struct list * bucket = &logged_table[sector % LOGGED_HASH_SIZE];
+  struct list_elem * e;
+
+  for(e = list_begin(bucket); e != list_end(bucket); e = list_next(e))
+  {
+    struct logged_sector * l = list_entry(e, struct logged_sector, elem);
+    if(l->sector == sector)
+      return l;
+  }
+  return NULL;
+}
+
+/* Removes L from logged_table.  The caller must hold
+   journal_lock. */
+static void
+logged_drop(struct logged_sector * l)
+{
+  list_remove(&l->elem);
+  list_push_front(&logged_free, &l->elem);
+  logged_cnt--;
+}
+
+/* Returns true if SECTOR has been logged by a transaction still
+   in the log, so that freeing it needs a revocation. */
+static bool
+is_logged(disk_sector_t sector)
+{
+  bool found;
+
+  if(logged_cnt == 0)
+    return false;
+  lock_acquire(&journal_lock);
+  found = logged_find(sector) != NULL;
+  lock_release(&journal_lock);
+  return found;
+}
+
+/* Records in logged_table what transaction SEQ did: the sectors
+   of its CNT BLOCKS are now in the log up to SEQ, and the ones it
+   revoked no longer are. */
+static void
+logged_note(struct buffcache_elem ** blocks, int cnt, uint32_t seq)
+{
+  size_t r;
+  int i;
+
+  lock_acquire(&journal_lock);
+  for(i = 0; i < cnt; i++)
+  {
+    struct logged_sector * l = logged_find(blocks[i]->sector);
+
+    if(l == NULL)
+    {
+      ASSERT(!list_empty(&logged_free));
+      l = list_entry(list_pop_front(&logged_free), struct logged_sector, elem);
+      l->sector = blocks[i]->sector;
+      list_push_front(&logged_table[l->sector % LOGGED_HASH_SIZE], &l->elem);
+      logged_cnt++;
+    }
+    l->seq = seq;
+  }
+  for(r = 0; r < txn_revoke_cnt; r++)
+  {
+    struct logged_sector * l = logged_find(txn_revokes[r]);
+
+    if(l != NULL)
+      logged_drop(l);
+  }
+  lock_release(&journal_lock);
+}
+
+/* Drops the transactions older than OLDEST from the log, or all
+   of them if OLDEST is 0, along with the sectors only they
+   logged. */
+static void
+log_retire(uint32_t oldest)
+{
+  uint32_t tail_seq;
+  int i;
+
+  while(txn_cnt > 0 && (oldest == 0 || txns[txn_first].seq < oldest))
+  {
+    log_used -= txns[txn_first].len;
+    txn_first = (txn_first + 1) % JOURNAL_TXN_CNT;
+    txn_cnt--;
+  }
+  tail_seq = txn_cnt > 0 ? txns[txn_first].seq : next_seq;
+
+  lock_acquire(&journal_lock);
+  for(i = 0; i < LOGGED_HASH_SIZE; i++)
+  {
+    struct list_elem * e, * next;
+
+    for(e = list_begin(&logged_table[i]); e != list_end(&logged_table[i]);
+        e = next)
+    {
+      struct logged_sector * l = list_entry(e, struct logged_sector, elem);
+      next = list_next(e);
+      if(l->seq < tail_seq)
+        logged_drop(l);
+    }
+  }
+  lock_release(&journal_lock);
+}
+
+/* Makes room for NEED more sectors in the log, first by dropping
+   the transactions whose blocks are all in place, then if that
+   is not enough by writing every logged block in place.  Writes
+   the header if its tail moved, before the space is reused. */
+static void
+log_reserve(size_t need)
+{
+  ASSERT(need <= log_size);
+
+  log_retire(buffer_journal_oldest());
+  if(log_used + need > log_size)
+  {
+    buffer_journal_checkpoint();
+    journal_stats.journal_checkpoints++;
+    log_retire(0);
+  }
+  header_update(false);
+}
+
+/* Writes a transaction to the log holding the txn_revoke_cnt
+   revocations in txn_revokes[] and the CNT BLOCKS taken by
+   buffer_journal_take(), then gives the blocks back to the cache.
+   The transaction is a descriptor for each JOURNAL_TXN_MAX
+   entries, revocations first, each followed by the blocks it
+   logs, then the commit block. */
+static void
+txn_write(struct buffcache_elem ** blocks, int cnt)
+{
+  static struct journal_desc descs[JOURNAL_DESC_MAX];
+  static struct journal_commit commit;
+  static const void * bufs[JOURNAL_SECTORS];
+  static disk_sector_t pos[JOURNAL_SECTORS];
+  size_t entries = txn_revoke_cnt + cnt;
+  uint32_t seq = next_seq;
+  uint32_t sum = seq;
+  size_t len = 0;
+  size_t i;
+  int d;
+
+  ASSERT(cnt <= batch_max);
+
+  /* Lay it out, descriptors first so the checksum can cover
+     them. */
+  for(i = 0, d = -1; i < entries; i++)
+  {
+    struct journal_desc * desc;
+
+    if(i % JOURNAL_TXN_MAX == 0)
+    {
+      desc = &descs[++d];
+      memset(desc, 0, sizeof *desc);
+      desc->magic = JOURNAL_DESC_MAGIC;
+      desc->seq = seq;
+      bufs[len++] = desc;
+    }
+    desc = &descs[d];
+    if(i < txn_revoke_cnt)
+      desc->entries[desc->cnt++] = txn_revokes[i] | JOURNAL_REVOKE_BIT;
+    else
+    {
+      desc->entries[desc->cnt++] = blocks[i - txn_revoke_cnt]->sector;
+      bufs[len++] = blocks[i - txn_revoke_cnt]->data;
+    }
+  }
+  for(i = 0; i < len; i++)
+    sum = checksum(sum, bufs[i]);
+  log_reserve(len + 1);
+  for(i = 0, len = 0; i < entries; i++)
+  {
+    if(i % JOURNAL_TXN_MAX == 0)
+      len++;
+    if(i >= txn_revoke_cnt)
+      pos[i - txn_revoke_cnt] = log_sector(log_head + len++);
+  }
+
+  /* The descriptors and the blocks, in one go, or two if the log
+     wraps around.  Then the commit block, which makes it count. */
+  log_write(log_head, len, bufs);
+  memset(&commit, 0, sizeof commit);
+  commit.magic = JOURNAL_COMMIT_MAGIC;
+  commit.seq = seq;
+  commit.checksum = sum;
+  disk_write(filesys_disk, log_sector(log_head + len), &commit);
+  len++;
+
+  txns[(txn_first + txn_cnt) % JOURNAL_TXN_CNT] =
+    (struct journal_txn) {seq, log_head, len};
+  txn_cnt++;
+  log_head = (log_head + len) % log_size;
+  log_used += len;
+  next_seq++;
+  journal_stats.journal_commits++;
+  journal_stats.journal_blocks += cnt;
+  journal_stats.journal_revokes += txn_revoke_cnt;
+
+  logged_note(blocks, cnt, seq);
+  lock_acquire(&journal_lock);
+  committing = 0;
+  lock_release(&journal_lock);
+  buffer_journal_done(blocks, cnt, seq, pos);
+}
+
+/* Notes the revocations that the transaction being committed
+   needs for the CNT sectors from START, whose free it commits:
+   one for each sector that a transaction in the log logged, or
+   that the cache holds for this one to log. */
+static void
+revoke_run(size_t start, size_t cnt)
+{
+  size_t sector;
+
+  for(sector = start; sector < start + cnt; sector++)
+    if(is_logged(sector) || buffer_journal_holds(sector))
+    {
+      ASSERT(txn_revoke_cnt < JOURNAL_REVOKE_MAX);
+      txn_revokes[txn_revoke_cnt++] = sector;
+    }
+}
+
+/* Commits every metadata change made so far, once the handles
+   running have ended.  Must not be called inside a handle. */
+void
+journal_commit(void)
+{
+  static struct buffcache_elem * blocks[JOURNAL_SECTORS];
+  int cnt;
+
+  if(!journal_on)
+    return;
+  ASSERT(thread_current()->journal_depth == 0);
+
+  lock_acquire(&commit_lock);
+
+  /* Take the blocks while no handle runs, so that none of them
+     holds half an operation. */
+  lock_acquire(&journal_lock);
+  commit_waiting = true;
+  while(handles > 0)
+    cond_wait(&handles_done, &journal_lock);
+  lock_release(&journal_lock);
+
+  txn_revoke_cnt = 0;
+  free_map_commit_take(revoke_run);
+  cnt = buffer_journal_take(blocks, batch_max);
+
+  lock_acquire(&journal_lock);
+  commit_waiting = false;
+  commit_soon = false;
+  committing = cnt;
+  cond_broadcast(&commit_done, &journal_lock);
+  lock_release(&journal_lock);
+
+  /* journal_begin() keeps the handles' blocks within BATCH_MAX, so
+     only blocks changed outside any handle, while formatting or
+     by fsutil at boot, can be left over.  They go in the next
+     transaction. */
+  if(cnt == batch_max)
+    journal_wake();
+  if(cnt > 0 || txn_revoke_cnt > 0)
+    txn_write(blocks, cnt);
+  free_map_commit_done();
+  lock_release(&commit_lock);
+}
+
+/* Called when an operation ran short of disk space.  If sectors
+   freed since the last commit are being held back, commits their
+   free and returns true, for the operation to try again.  Ends
+   the current handle to do so and starts another, so the caller
+   must hold no file system lock and have left nothing half done.
+   Returns false otherwise, or inside a nested handle. */
+bool
+journal_retry_alloc(void)
+{
+  struct thread * t = thread_current();
+
+  if(!journal_on || t->journal_depth > 1 || journal_committing()
+     || !free_map_has_freed())
+    return false;
+  if(t->journal_depth == 1)
+  {
+    journal_end();
+    journal_commit();
+    journal_begin();
+  }
+  else
+    journal_commit();
+  return true;
+}
+
+/* Returns true if the current thread is committing, for the
+   cache, which keeps a few blocks free for it. */
+bool
+journal_committing(void)
+{
+  return lock_held_by_current_thread(&commit_lock);
+}
+
+/* Asks for a commit: new handles wait for one, and the commit
+   thread makes one at its next nap unless a thread starting a
+   handle gets to it first. */
+void
+journal_wake(void)
+{
+  commit_soon = true;
+}
+
+/* Starts a handle: an operation whose metadata changes must go to
+   disk together, in no more than JOURNAL_CREDITS blocks.  Waits
+   while a commit is taking blocks, and commits first if one is
+   due, or if the running transaction has no room left for the
+   handle's blocks in the log or in the cache.  Must be called
+   before the operation takes any file system lock, so that no
+   commit can be waiting on a thread that waits on this one.
+   Handles nest, within the outermost one's credits. */
+void
+journal_begin(void)
+{
+  struct thread * t = thread_current();
+  int held, need;
+  bool fits;
+
+  if(t->journal_depth > 0)
+  {
+    t->journal_depth++;
+    return;
+  }
+  if(commit_soon)
+    journal_commit();
+  while(true)
+  {
+    held = buffer_journal_held();
+    lock_acquire(&journal_lock);
+    if(commit_waiting)
+    {
+      /* The commit changes what the cache holds. */
+      while(commit_waiting)
+        cond_wait(&commit_done, &journal_lock);
+      lock_release(&journal_lock);
+      continue;
+    }
+    need = held + credits + JOURNAL_CREDITS + commit_extra;
+    fits = !journal_on || need - committing <= batch_max;
+    if(fits && (!journal_on || need <= room))
+    {
+      handles++;
+      credits += JOURNAL_CREDITS;
+      lock_release(&journal_lock);
+      break;
+    }
+    lock_release(&journal_lock);
+
+    /* The cache may grow to make room; the log only empties
+       as transactions commit. */
+    if(fits)
+    {
+      int r = buffer_journal_room(need);
+
+      lock_acquire(&journal_lock);
+      if(room < r)
+        room = r;
+      lock_release(&journal_lock);
+      if(r >= need)
+        continue;
+    }
+    journal_commit();
+  }
+  t->journal_depth++;
+}
+
+/* Ends the handle started by the matching journal_begin(). */
+void
+journal_end(void)
+{
+  struct thread * t = thread_current();
+
+  ASSERT(t->journal_depth > 0);
+  if(--t->journal_depth > 0)
+    return;
+  lock_acquire(&journal_lock);
+  credits -= JOURNAL_CREDITS;
+  if(--handles == 0)
+    cond_signal(&handles_done, &journal_lock);
+  lock_release(&journal_lock);
+}
+
+/* Ends the current handle and starts another, for an operation
+   cut into parts that each leave the file system consistent and
+   fit in one handle's credits.  Does nothing inside a nested
+   handle, whose operation must fit in the outer one's. */
+void
+journal_restart(void)
+{
+  if(thread_current()->journal_depth != 1)
+    return;
+  journal_end();
+  journal_begin();
+}
+
+/* Ends whatever handle the current thread is in, for a process
+   killed in the middle of a system call. */
+void
+journal_exit(void)
+{
+  struct thread * t = thread_current();
+
+  if(t->journal_depth > 0)
+  {
+    t->journal_depth = 1;
+    journal_end();
+  }
+}
+
+/* Returns true if changes to blocks of class CLS are to be
+   logged. */
+bool
+journal_is_metadata(enum fsstat_class cls)
+{
+  return journal_on && cls != FSSTAT_DATA && cls < FSSTAT_CLASS_CNT;
+}
+
+/* Commits every JOURNAL_INTERVAL ticks, or sooner when asked to by
+   journal_wake(). */
+static void
+journal_daemon(void * aux UNUSED)
+{
+  int64_t last = timer_ticks();
+
+  while(true)
+  {
+    timer_sleep(JOURNAL_NAP);
+    if(journal_on && (commit_soon || timer_elapsed(last) >= JOURNAL_INTERVAL))
+    {
+      journal_commit();
+      last = timer_ticks();
+    }
+  }
+}
+
+/* Puts the journal at sector START to use, with the log empty
+   from position TAIL on and transaction SEQ next. */
+static void
+journal_start_at(disk_sector_t start, size_t sectors, size_t tail,
+                 uint32_t seq)
+{
+  static bool started;
+
+  journal_start = start;
+  log_size = sectors - 1;
+
+  /* A transaction takes a descriptor for each JOURNAL_TXN_MAX
+     entries, which may revoke up to one sector for each in the log
+     and each it logs, and a commit block. */
+  batch_max = log_size;
+  while(batch_max > 0
+        && batch_max + 1 + DIV_ROUND_UP (2 * batch_max + log_size,
+                                         JOURNAL_TXN_MAX) > log_size)
+    batch_max--;
+  commit_extra = DIV_ROUND_UP (disk_size(filesys_disk), DISK_SECTOR_SIZE * 8);
+  room = buffer_journal_room(JOURNAL_CREDITS + commit_extra);
+  if(batch_max < JOURNAL_CREDITS + commit_extra
+     || room < JOURNAL_CREDITS + commit_extra)
+    PANIC("journal_start_at: no room for one operation");
+  log_head = tail;
+  log_used = 0;
+  next_seq = seq;
+  txn_first = txn_cnt = 0;
+  header_update(true);
+  commit_soon = false;
+  journal_on = true;
+  if(!started)
+  {
+    started = true;
+    thread_create("journal", PRI_DEFAULT, journal_daemon, NULL);
+  }
+}
+
+/* Makes a journal for a file system being formatted and starts
+   using it.  Returns its first sector, which free_map_create()
+   keeps in the free map's inode, or -1 if there is no room on the
+   disk for one, in which case the file system goes without.
+   The log is zeroed first: the sectors are the same ones an
+   earlier file system on the disk used for its log, and replay
+   would take its transactions that follow ours for our own. */
+disk_sector_t
+journal_create(void)
+{
+  static const uint8_t zeros[DISK_SECTOR_SIZE];
+  static const void * bufs[JOURNAL_SECTORS];
+  disk_sector_t start;
+  size_t cnt, i;
+
+  cnt = free_map_allocate_run(FREE_MAP_SECTOR, JOURNAL_SECTORS, &start);
+  if(cnt < JOURNAL_SECTORS)
+  {
+    if(cnt > 0)
+      free_map_release(start, cnt);
+    return (disk_sector_t) -1;
+  }
+  ASSERT(JOURNAL_SECTORS <= DISK_MULTIPLE_MAX);
+  for(i = 0; i < JOURNAL_SECTORS; i++)
+    bufs[i] = zeros;
+  disk_write_multiple(filesys_disk, start, JOURNAL_SECTORS, bufs);
+  journal_start_at(start, JOURNAL_SECTORS, 0, 1);
+  return start;
+}
+
+/* Reads the transaction at log position POS, using DESC and BUF,
+   and checks that it is number SEQ and that it was committed
+   whole.  Returns its length in sectors and adds the revocations
+   it holds to *REVOKE_CNT, or returns 0 if it is not. */
+static size_t
+txn_check(size_t pos, uint32_t seq, struct journal_desc * desc, void * buf,
+          size_t * revoke_cnt)
+{
+  const struct journal_commit * commit = (const struct journal_commit *) desc;
+  disk_sector_t size = disk_size(filesys_disk);
+  uint32_t sum = seq;
+  size_t revokes = 0;
+  size_t p = pos;
+  size_t i;
+
+  while(p - pos < log_size)
+  {
+    disk_read(filesys_disk, log_sector(p), desc);
+    if(desc->seq != seq)
+      return 0;
+    if(desc->magic == JOURNAL_COMMIT_MAGIC && p > pos)
+    {
+      if(commit->checksum != sum)
+        return 0;
+      *revoke_cnt += revokes;
+      return p - pos + 1;
+    }
+    if(desc->magic != JOURNAL_DESC_MAGIC || desc->cnt > JOURNAL_TXN_MAX)
+      return 0;
+
+    sum = checksum(sum, desc);
+    for(i = 0; i < desc->cnt; i++)
+    {
+      if((desc->entries[i] & ~JOURNAL_REVOKE_BIT) >= size)
+        return 0;
+      if(desc->entries[i] & JOURNAL_REVOKE_BIT)
+      {
+        revokes++;
+        continue;
+      }
+      if(++p - pos >= log_size)
+        return 0;
+      disk_read(filesys_disk, log_sector(p), buf);
+      sum = checksum(sum, buf);
+    }
+    p++;
+  }
+  return 0;
+}
+
+/* Returns true if one of the CNT REVOKES, which are sector
+   numbers each followed by the transaction that revoked it,
+   keeps a copy of SECTOR logged by transaction SEQ from being
+   replayed: a revocation covers the copies logged by its own
+   transaction and older ones. */
+static bool
+revoked(const uint32_t * revokes, size_t cnt, disk_sector_t sector,
+        uint32_t seq)
+{
+  size_t i;
+
+  for(i = 0; i < cnt; i++)
+    if(revokes[2 * i] == sector && revokes[2 * i + 1] >= seq)
+      return true;
+  return false;
+}
+
+/* Goes through transaction T, checked by txn_check(), using DESC
+   and BUF.  If COLLECT, appends its revocations to REVOKES from
+   *REVOKE_CNT on.  Otherwise writes the blocks it logged in
+   place, but for those that the *REVOKE_CNT REVOKES keep from
+   being replayed. */
+static void
+txn_replay(const struct journal_txn * t, struct journal_desc * desc,
+           void * buf, uint32_t * revokes, size_t * revoke_cnt, bool collect)
+{
+  size_t p = t->pos;
+  size_t i;
+
+  while(p < t->pos + t->len - 1)
+  {
+    disk_read(filesys_disk, log_sector(p), desc);
+    for(i = 0; i < desc->cnt; i++)
+    {
+      disk_sector_t sector = desc->entries[i] & ~JOURNAL_REVOKE_BIT;
+
+      if(desc->entries[i] & JOURNAL_REVOKE_BIT)
+      {
+        if(collect)
+        {
+          revokes[2 * *revoke_cnt] = sector;
+          revokes[2 * *revoke_cnt + 1] = t->seq;
+          ++*revoke_cnt;
+        }
+        continue;
+      }
+      p++;
+      if(collect || revoked(revokes, *revoke_cnt, sector, t->seq))
+        continue;
+      disk_read(filesys_disk, log_sector(p), buf);
+      disk_write(filesys_disk, sector, buf);
+    }
+    p++;
+  }
+}
+
+/* Replays the transactions in the log from position TAIL on,
+   starting with number SEQ, and leaves the log empty after the
+   last one.  Uses txns[] along the way. */
+static void
+journal_replay(size_t tail, uint32_t seq)
+{
+  struct journal_desc * desc = malloc(sizeof *desc);
+  uint8_t * buf = malloc(DISK_SECTOR_SIZE);
+  uint32_t * revokes = NULL;
+  size_t revoke_cnt = 0;
+  size_t pos = tail;
+  size_t used = 0;
+  size_t len, i;
+
+  if(desc == NULL || buf == NULL)
+    PANIC("journal_replay: out of memory");
+
+  /* Find the transactions committed whole. */
+  txn_cnt = 0;
+  while(txn_cnt < JOURNAL_TXN_CNT
+        && (len = txn_check(pos, seq, desc, buf, &revoke_cnt)) > 0
+        && used + len <= log_size)
+  {
+    txns[txn_cnt++] = (struct journal_txn) {seq, pos, len};
+    pos = (pos + len) % log_size;
+    used += len;
+    seq++;
+  }
+
+  /* Collect their revocations, then write the blocks in place,
+     oldest first. */
+  if(revoke_cnt > 0)
+  {
+    revokes = malloc(revoke_cnt * 2 * sizeof *revokes);
+    if(revokes == NULL)
+      PANIC("journal_replay: out of memory");
+    revoke_cnt = 0;
+    for(i = 0; i < txn_cnt; i++)
+      txn_replay(&txns[i], desc, buf, revokes, &revoke_cnt, true);
+  }
+  for(i = 0; i < txn_cnt; i++)
+    txn_replay(&txns[i], desc, buf, revokes, &revoke_cnt, false);
+  if(txn_cnt > 0)
+    printf("Replayed %zu journal transactions.\n", txn_cnt);
+  journal_stats.journal_replays = txn_cnt;
+
+  free(revokes);
+  free(buf);
+  free(desc);
+  journal_start_at(journal_start, log_size + 1, pos, seq);
+}
+
+/* Finds the journal of the file system on disk, if it has one,
+   replays it and starts using it.  Must be called before
+   anything else reads the disk through the buffer cache. */
+void
+journal_mount(void)
+{
+  uint8_t * buf = malloc(DISK_SECTOR_SIZE);
+  const struct journal_header * h = (const struct journal_header *) buf;
+  disk_sector_t size = disk_size(filesys_disk);
+  disk_sector_t start;
+
+  if(buf == NULL)
+    PANIC("journal_mount: out of memory");
+
+  /* The journal's first sector is kept in the free map's inode,
+     in the parent field, which the free map has no other use for.
+     File systems formatted before there was a journal have -1
+     there. */
+  disk_read(filesys_disk, FREE_MAP_SECTOR, buf);
+  memcpy(&start, buf + offsetof(struct inode_disk, parent), sizeof start);
+  if(start > FREE_MAP_SECTOR && start < size)
+  {
+    disk_read(filesys_disk, start, buf);
+    if(h->magic == JOURNAL_MAGIC && h->sectors >= 3
+       && h->sectors <= JOURNAL_SECTORS && h->sectors <= size - start
+       && h->tail < h->sectors - 1)
+    {
+      journal_start = start;
+      log_size = h->sectors - 1;
+      journal_replay(h->tail, h->seq);
+    }
+  }
+  free(buf);
+}
+
+/* Commits what is left, writes every block in place and empties
+   the log, then stops using the journal. */
+void
+journal_done(void)
+{
+  if(!journal_on)
+    return;
+  do
+    journal_commit();
+  while(buffer_journal_held() > 0);
+  buffer_flush_all();
+
+  lock_acquire(&commit_lock);
+  buffer_journal_checkpoint();
+  log_retire(0);
+  header_update(false);
+  journal_on = false;
+  lock_release(&commit_lock);
+}
+
+/* Copies the journal statistics into the matching fields of ST,
+   leaving the others alone. */
+void
+journal_get_stats(struct fsstat * st)
+{
+  st->journal_commits = journal_stats.journal_commits;
+  st->journal_blocks = journal_stats.journal_blocks;
+  st->journal_revokes = journal_stats.journal_revokes;
+  st->journal_checkpoints = journal_stats.journal_checkpoints;
+  st->journal_replays = journal_stats.journal_replays;
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats(void)
+{
+  struct fsstat st;
+
+  journal_get_stats(&st);
+  printf("Journal: %lld commits of %lld blocks and %lld revocations, "
+         "%lld full-log checkpoints, %lld transactions replayed\n",
+         st.journal_commits, st.journal_blocks, st.journal_revokes,
+         st.journal_checkpoints, st.journal_replays);
+}
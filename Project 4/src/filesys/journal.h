@@ -0,0 +1,50 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <fsstat.h>
+#include "devices/disk.h"
+#include "devices/timer.h"
+
+/* Size of the journal made at format time, in sectors. */
+#define JOURNAL_SECTORS 256
+
+/* Group commit.  The commit thread wakes every JOURNAL_NAP ticks
+   and commits once JOURNAL_INTERVAL ticks have passed since the
+   last commit, or sooner if the cache asks: when more than
+   JOURNAL_HELD_PERCENT of it, or more than half as many blocks as
+   the journal has sectors, are waiting for the journal, or when
+   it finds nothing to evict.  The cache keeps JOURNAL_RESERVE
+   blocks out of the journal's hands for the commit itself. */
+#define JOURNAL_NAP (TIMER_FREQ / 10)
+#define JOURNAL_INTERVAL TIMER_FREQ
+#define JOURNAL_HELD_PERCENT 25
+#define JOURNAL_RESERVE 8
+
+/* Handles.  journal_begin() reserves room for JOURNAL_CREDITS
+   metadata blocks, enough for any one operation but a long write
+   or the write-back of a long mapping, which restart their handle
+   every JOURNAL_WRITE_MAX bytes. */
+#define JOURNAL_CREDITS 32
+#define JOURNAL_WRITE_MAX (16 * DISK_SECTOR_SIZE)
+
+void journal_init (void);
+disk_sector_t journal_create (void);
+void journal_mount (void);
+void journal_done (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_restart (void);
+void journal_exit (void);
+void journal_commit (void);
+bool journal_retry_alloc (void);
+bool journal_committing (void);
+
+bool journal_is_metadata (enum fsstat_class);
+void journal_wake (void);
+
+void journal_get_stats (struct fsstat *);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,22 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+/* Maximum length of a name in a struct dirent. */
+#define DIRENT_NAME_MAX 14
+
+/* Kinds of file named by a struct dirent. */
+enum dirent_type
+  {
+    DIRENT_FILE,                /* Ordinary file. */
+    DIRENT_DIR                  /* Directory. */
+  };
+
+/* A directory entry, as returned by the getdents system call. */
+struct dirent
+  {
+    int inumber;                /* Inode number of the file. */
+    enum dirent_type type;      /* Kind of file. */
+    char name[DIRENT_NAME_MAX + 1]; /* Null terminated file name. */
+  };
+
+#endif /* lib/dirent.h */
@@ -0,0 +1,52 @@
+#ifndef __LIB_FSSTAT_H
+#define __LIB_FSSTAT_H
+
+/* Kinds of block that the buffer cache counts separately. */
+enum fsstat_class
+  {
+    FSSTAT_INODE,               /* On-disk inodes. */
+    FSSTAT_INDIRECT,            /* Indirect and doubly indirect blocks. */
+    FSSTAT_DIR,                 /* Directory contents. */
+    FSSTAT_FREEMAP,             /* Free map contents. */
+    FSSTAT_DATA,                /* Ordinary file contents. */
+    FSSTAT_CLASS_CNT
+  };
+
+/* File system statistics, as returned by the fsstat system call.
+   Counts are since boot. */
+struct fsstat
+  {
+    /* Buffer cache. */
+    long long hits[FSSTAT_CLASS_CNT];   /* Blocks found in the cache. */
+    long long misses[FSSTAT_CLASS_CNT]; /* Blocks not found in the cache. */
+    long long read_fills;       /* Misses read from disk. */
+    long long write_fills;      /* ...of which partial writes. */
+    long long fill_skips;       /* Misses on whole-sector writes, not read. */
+    long long read_aheads;      /* Blocks loaded by read-ahead. */
+    long long evictions;        /* Blocks reused for another sector. */
+    long long writebacks;       /* Dirty blocks written to disk. */
+    int cache_sectors;          /* Current size of the cache. */
+
+    /* Inodes. */
+    long long inode_opens;      /* inode_open() calls that read an inode. */
+    long long inode_reopens;    /* inode_open() calls for an open inode. */
+    long long inode_revives;    /* ...for a closed one still in memory. */
+    long long bytes_read;       /* Returned by inode_read_at(). */
+    long long hole_bytes;       /* ...of which read from holes. */
+    long long bytes_written;    /* Returned by inode_write_at(). */
+    long long extends;          /* Writes that grew an inode. */
+
+    /* Directory entry cache. */
+    long long dentry_hits;      /* Lookups answered from the cache. */
+    long long dentry_negative_hits; /* ...that found no such name. */
+    long long dentry_misses;    /* Lookups that read the directory. */
+
+    /* Journal. */
+    long long journal_commits;  /* Transactions written to the log. */
+    long long journal_blocks;   /* Metadata blocks logged. */
+    long long journal_revokes;  /* Sectors revoked for reuse as data. */
+    long long journal_checkpoints; /* Times the log filled up. */
+    long long journal_replays;  /* Transactions replayed at mount. */
+  };
+
+#endif /* lib/fsstat.h */
@@ -27,7 +27,9 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+    SYS_FSSTAT,                 /* Reads file system statistics. */
+    SYS_GETDENTS                /* Reads many directory entries. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,15 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+fsstat (struct fsstat *st) 
+{
+  return syscall1 (SYS_FSSTAT, st);
+}
+
+int
+getdents (int fd, struct dirent *ents, unsigned cnt) 
+{
+  return syscall3 (SYS_GETDENTS, fd, ents, cnt);
+}
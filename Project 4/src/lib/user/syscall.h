@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <dirent.h>
+#include <fsstat.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -44,5 +46,7 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+bool fsstat (struct fsstat *st);
+int getdents (int fd, struct dirent *ents, unsigned cnt);
 
 #endif /* lib/user/syscall.h */
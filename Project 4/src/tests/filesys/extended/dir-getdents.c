@@ -0,0 +1,80 @@
+/* Reads a directory of 10 files and a subdirectory with getdents,
+   a few entries at a time, checking that the last call before the
+   end comes up short, that the end returns 0, and that each entry
+   has the right inode number and type. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 10
+#define ENT_CNT (FILE_CNT + 1)  /* The files, then "sub". */
+#define BATCH 4
+
+static char names[ENT_CNT][READDIR_MAX_LEN + 1];
+static bool seen[ENT_CNT];
+
+void
+test_main (void) 
+{
+  struct dirent ents[BATCH];
+  char path[32];
+  size_t i;
+  int fd, n, expect, total = 0;
+
+  CHECK (mkdir ("/d"), "mkdir \"/d\"");
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (names[i], sizeof names[i], "f%zu", i);
+      snprintf (path, sizeof path, "/d/f%zu", i);
+      CHECK (create (path, 0), "create \"%s\"", path);
+    }
+  strlcpy (names[FILE_CNT], "sub", sizeof names[FILE_CNT]);
+  CHECK (mkdir ("/d/sub"), "mkdir \"/d/sub\"");
+
+  CHECK ((fd = open ("/d")) > 1, "open \"/d\"");
+  CHECK (getdents (fd, ents, 0) == 0, "getdents \"/d\" for no entries");
+  do
+    {
+      expect = ENT_CNT - total < BATCH ? ENT_CNT - total : BATCH;
+      n = getdents (fd, ents, BATCH);
+      msg ("getdents \"/d\" returned %d", n);
+      if (n != expect)
+        fail ("getdents \"/d\" returned %d, expected %d", n, expect);
+      for (i = 0; i < (size_t) n; i++)
+        {
+          size_t j;
+          int file_fd;
+
+          for (j = 0; j < ENT_CNT; j++)
+            if (!strcmp (ents[i].name, names[j]))
+              break;
+          if (j >= ENT_CNT)
+            fail ("getdents returned unexpected name \"%s\"", ents[i].name);
+          if (seen[j])
+            fail ("getdents returned \"%s\" twice", ents[i].name);
+          seen[j] = true;
+
+          if (ents[i].type != (j == FILE_CNT ? DIRENT_DIR : DIRENT_FILE))
+            fail ("getdents gave \"%s\" the wrong type", ents[i].name);
+          snprintf (path, sizeof path, "/d/%s", ents[i].name);
+          if ((file_fd = open (path)) < 2)
+            fail ("open \"%s\" failed", path);
+          if (inumber (file_fd) != ents[i].inumber)
+            fail ("getdents gave \"%s\" inode %d, not %d",
+                  ents[i].name, ents[i].inumber, inumber (file_fd));
+          close (file_fd);
+        }
+      total += n;
+    }
+  while (n > 0);
+  msg ("close \"/d\"");
+  close (fd);
+
+  CHECK ((fd = open ("/d/f0")) > 1, "open \"/d/f0\"");
+  CHECK (getdents (fd, ents, BATCH) == -1, "getdents \"/d/f0\" must fail");
+  msg ("close \"/d/f0\"");
+  close (fd);
+}
@@ -0,0 +1,31 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-getdents) begin
+(dir-getdents) mkdir "/d"
+(dir-getdents) create "/d/f0"
+(dir-getdents) create "/d/f1"
+(dir-getdents) create "/d/f2"
+(dir-getdents) create "/d/f3"
+(dir-getdents) create "/d/f4"
+(dir-getdents) create "/d/f5"
+(dir-getdents) create "/d/f6"
+(dir-getdents) create "/d/f7"
+(dir-getdents) create "/d/f8"
+(dir-getdents) create "/d/f9"
+(dir-getdents) mkdir "/d/sub"
+(dir-getdents) open "/d"
+(dir-getdents) getdents "/d" for no entries
+(dir-getdents) getdents "/d" returned 4
+(dir-getdents) getdents "/d" returned 4
+(dir-getdents) getdents "/d" returned 3
+(dir-getdents) getdents "/d" returned 0
+(dir-getdents) close "/d"
+(dir-getdents) open "/d/f0"
+(dir-getdents) getdents "/d/f0" must fail
+(dir-getdents) close "/d/f0"
+(dir-getdents) end
+EOF
+pass;
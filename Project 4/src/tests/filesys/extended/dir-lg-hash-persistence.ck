@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+# The file system's 32-bit FNV-1a hash of a name.
+sub name_hash {
+    my ($hash) = 2166136261;
+    foreach my $c (unpack ("C*", $_[0])) {
+	$hash = (($hash ^ $c) * 16777619) % 4294967296;
+    }
+    return $hash;
+}
+
+my (@names) = map ("file$_", 0...59);
+for (my ($j) = 0; @names < 100; $j++) {
+    push (@names, "same$j") if (name_hash ("same$j") & 0x7f) == 0;
+}
+my ($big) = {};
+$big->{$names[$_]} = [""] foreach grep ($_ % 3, 0...$#names);
+check_archive ({"big" => $big});
+pass;
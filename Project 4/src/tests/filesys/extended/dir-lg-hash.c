@@ -0,0 +1,118 @@
+/* Fills a directory well past the space inside its inode, so
+   that it is rebuilt as a hash table, with enough names in one
+   hash bucket that the bucket splits as far as it can and then
+   chains overflow blocks.  Removes every third file, then checks
+   that readdir returns each remaining name exactly once and that
+   only the remaining names can be opened. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define DIRECTORY "/big"
+#define PLAIN_CNT 60            /* Names spread over the buckets. */
+#define SAME_CNT 40             /* Names that all share a bucket. */
+#define FILE_CNT (PLAIN_CNT + SAME_CNT)
+
+static char names[FILE_CNT][READDIR_MAX_LEN + 1];
+static bool seen[FILE_CNT];
+
+/* Returns the hash the file system gives NAME, by the 32-bit
+   FNV-1a function.  Its low 7 bits pick a bucket. */
+static unsigned
+name_hash (const char *name)
+{
+  unsigned hash = 2166136261u;
+
+  for (; *name != '\0'; name++)
+    hash = (hash ^ (unsigned char) *name) * 16777619u;
+  return hash;
+}
+
+/* Returns the path of file I. */
+static const char *
+file_path (size_t i)
+{
+  static char path[sizeof DIRECTORY + READDIR_MAX_LEN + 1];
+
+  strlcpy (path, DIRECTORY "/", sizeof path);
+  strlcat (path, names[i], sizeof path);
+  return path;
+}
+
+/* Returns true if file I is one of those removed. */
+static bool
+removed (size_t i)
+{
+  return i % 3 == 0;
+}
+
+void
+test_main (void) 
+{
+  char name[READDIR_MAX_LEN + 1];
+  const char *path;
+  size_t i, j;
+  int fd;
+
+  for (i = 0; i < PLAIN_CNT; i++)
+    snprintf (names[i], sizeof names[i], "file%zu", i);
+  for (j = 0; i < FILE_CNT; j++)
+    {
+      snprintf (names[i], sizeof names[i], "same%zu", j);
+      if ((name_hash (names[i]) & 0x7f) == 0)
+        i++;
+    }
+
+  CHECK (mkdir (DIRECTORY), "mkdir %s", DIRECTORY);
+  msg ("creating %d files in %s", FILE_CNT, DIRECTORY);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      path = file_path (i);
+      CHECK (create (path, 0), "create \"%s\"", path);
+    }
+  quiet = false;
+
+  msg ("removing every third file");
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++)
+    if (removed (i))
+      {
+        path = file_path (i);
+        CHECK (remove (path), "remove \"%s\"", path);
+      }
+  quiet = false;
+
+  CHECK ((fd = open (DIRECTORY)) > 1, "open \"%s\"", DIRECTORY);
+  msg ("readdir \"%s\"", DIRECTORY);
+  while (readdir (fd, name))
+    {
+      for (i = 0; i < FILE_CNT; i++)
+        if (!strcmp (name, names[i]))
+          break;
+      if (i >= FILE_CNT || removed (i))
+        fail ("readdir returned unexpected name \"%s\"", name);
+      if (seen[i])
+        fail ("readdir returned \"%s\" twice", name);
+      seen[i] = true;
+    }
+  for (i = 0; i < FILE_CNT; i++)
+    if (!removed (i) && !seen[i])
+      fail ("readdir did not return \"%s\"", names[i]);
+  msg ("close \"%s\"", DIRECTORY);
+  close (fd);
+
+  msg ("opening each file");
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      path = file_path (i);
+      fd = open (path);
+      if (removed (i) ? fd != -1 : fd < 2)
+        fail ("open \"%s\" returned %d", path, fd);
+      if (fd > 1)
+        close (fd);
+    }
+}
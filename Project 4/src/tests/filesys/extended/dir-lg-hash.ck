@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-lg-hash) begin
+(dir-lg-hash) mkdir /big
+(dir-lg-hash) creating 100 files in /big
+(dir-lg-hash) removing every third file
+(dir-lg-hash) open "/big"
+(dir-lg-hash) readdir "/big"
+(dir-lg-hash) close "/big"
+(dir-lg-hash) opening each file
+(dir-lg-hash) end
+EOF
+pass;
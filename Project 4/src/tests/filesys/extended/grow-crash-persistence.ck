@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+my (@output) = read_text_file ("$test.output");
+
+fail "file system was not recovered from the journal\n"
+  if !grep (/^Replayed \d+ journal transactions\.$/, @output);
+check_archive ({"b" => ["b" x (100 * 1024)], "c" => ["c" x 10]});
+pass;
@@ -0,0 +1,77 @@
+/* Writes a file big enough to need an indirect block, removes it,
+   and writes a small file and another big one in the blocks it
+   freed, waiting for the journal to commit after each step.  The
+   small file shifts the second big file by a sector, so that its
+   data lands where the first one's inode and indirect block were.
+   The kernel runs with -crash, so it powers off without writing
+   its metadata in place, and the persistence run recovers the
+   file system by replaying the log, which must not write the old
+   copies of those blocks over the new data. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define BIG_SIZE (100 * 1024)
+#define SMALL_SIZE 10
+
+static char buf[BIG_SIZE];
+
+/* Returns the number of transactions the journal has committed. */
+static long long
+commits (void)
+{
+  struct fsstat st;
+
+  if (!fsstat (&st))
+    fail ("fsstat failed");
+  return st.journal_commits;
+}
+
+/* Waits until the journal has committed every change made so far.
+   Each round makes a change of its own after noting the count, so
+   that a commit is sure to follow; the second round's commit
+   starts after the first round's ends, so after this call
+   began. */
+static void
+wait_commit (void)
+{
+  int round;
+
+  for (round = 0; round < 2; round++)
+    {
+      long long before = commits ();
+
+      if (!create ("tmp", 0) || !remove ("tmp"))
+        fail ("create and remove \"tmp\" failed");
+      while (commits () == before)
+        continue;
+    }
+}
+
+/* Creates NAME and fills it with SIZE bytes of C. */
+static void
+write_file (const char *name, char c, int size)
+{
+  int fd;
+
+  CHECK (create (name, 0), "create \"%s\"", name);
+  CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+  memset (buf, c, size);
+  CHECK (write (fd, buf, size) == size, "write \"%s\"", name);
+  msg ("close \"%s\"", name);
+  close (fd);
+}
+
+void
+test_main (void)
+{
+  write_file ("a", 'a', BIG_SIZE);
+  wait_commit ();
+  CHECK (remove ("a"), "remove \"a\"");
+  wait_commit ();
+  write_file ("c", 'c', SMALL_SIZE);
+  write_file ("b", 'b', BIG_SIZE);
+  wait_commit ();
+}
@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-crash) begin
+(grow-crash) create "a"
+(grow-crash) open "a"
+(grow-crash) write "a"
+(grow-crash) close "a"
+(grow-crash) remove "a"
+(grow-crash) create "c"
+(grow-crash) open "c"
+(grow-crash) write "c"
+(grow-crash) close "c"
+(grow-crash) create "b"
+(grow-crash) open "b"
+(grow-crash) write "b"
+(grow-crash) close "b"
+(grow-crash) end
+EOF
+pass;
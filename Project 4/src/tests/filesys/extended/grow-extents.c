@@ -0,0 +1,49 @@
+/* On a disk formatted with extent inodes, writes every other
+   sector of a file and then the sectors in between.  The first
+   pass leaves 100 separate extents, more than fit in the inode,
+   so the extent tree grows a level; the second fills every hole
+   between them. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SECTOR_CNT 200
+#define FILE_SIZE (SECTOR_CNT * 512)
+static char buf[FILE_SIZE];
+
+/* Writes the sectors of FILE_NAME, open as FD, from FIRST on,
+   every other one. */
+static void
+write_sectors (int fd, const char *file_name, int first)
+{
+  int i;
+
+  for (i = first; i < SECTOR_CNT; i += 2)
+    {
+      seek (fd, i * 512);
+      if (write (fd, buf + i * 512, 512) != 512)
+        fail ("write sector %d of \"%s\" failed", i, file_name);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("write even sectors of \"%s\"", file_name);
+  write_sectors (fd, file_name, 0);
+  msg ("write odd sectors of \"%s\"", file_name);
+  write_sectors (fd, file_name, 1);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($testfile) = random_bytes (2000);
+my ($small) = random_bytes (123);
+check_archive ({"testfile" => [$testfile], "small" => [$small]});
+pass;
@@ -0,0 +1,49 @@
+/* Grows a file a few bytes at a time past the space for data
+   inside its inode, checking its contents at each step, and
+   leaves a second file small enough to stay inside its inode. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 2000
+#define SMALL_SIZE 123
+static char buf[FILE_SIZE];
+static char small[SMALL_SIZE];
+
+/* Sizes to grow "testfile" to, one after another.  The inode
+   holds up to 496 bytes of data itself. */
+static const size_t sizes[] = {300, 496, 497, 1024, FILE_SIZE};
+
+void
+test_main (void) 
+{
+  size_t ofs = 0;
+  size_t i;
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  random_bytes (small, sizeof small);
+
+  CHECK (create ("testfile", 0), "create \"testfile\"");
+  CHECK ((fd = open ("testfile")) > 1, "open \"testfile\"");
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    {
+      size_t size = sizes[i] - ofs;
+      CHECK (write (fd, buf + ofs, size) == (int) size,
+             "write \"testfile\" up to %zu bytes", sizes[i]);
+      ofs = sizes[i];
+      check_file ("testfile", buf, ofs);
+    }
+  msg ("close \"testfile\"");
+  close (fd);
+
+  CHECK (create ("small", 0), "create \"small\"");
+  CHECK ((fd = open ("small")) > 1, "open \"small\"");
+  CHECK (write (fd, small, sizeof small) == SMALL_SIZE, "write \"small\"");
+  msg ("close \"small\"");
+  close (fd);
+  check_file ("small", small, sizeof small);
+}
@@ -0,0 +1,39 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-inline) begin
+(grow-inline) create "testfile"
+(grow-inline) open "testfile"
+(grow-inline) write "testfile" up to 300 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) write "testfile" up to 496 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) write "testfile" up to 497 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) write "testfile" up to 1024 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) write "testfile" up to 2000 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) close "testfile"
+(grow-inline) create "small"
+(grow-inline) open "small"
+(grow-inline) write "small"
+(grow-inline) close "small"
+(grow-inline) open "small" for verification
+(grow-inline) verified contents of "small"
+(grow-inline) close "small"
+(grow-inline) end
+EOF
+pass;
@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($big) = join ('', map (chr (($_ + 2) & 0xff) x 512, 0...2047));
+my ($log) = "a" x 200 . "b" x 200 . "c" x 200;
+check_archive ({"big" => [$big], "log" => [$log]});
+pass;
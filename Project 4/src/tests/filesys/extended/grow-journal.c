@@ -0,0 +1,85 @@
+/* Writes a 1 MB file, about half the disk, removes it, and writes
+   it again, three times over, so that each round needs blocks
+   that the round before it freed.  The journal has to commit
+   those frees before the blocks can be used again.  A small file
+   grows a little each round, out of its inode on the last. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define BIG_SIZE (1024 * 1024)
+#define LOG_SIZE 200
+#define ROUNDS 3
+
+static char block[4096];
+static char readback[4096];
+
+/* Fills BLOCK with the contents of "big" in ROUND at offset OFS.
+   Each sector holds a single byte value, different in each
+   round, so that a block left over from an earlier round shows
+   up. */
+static void
+fill (int round, size_t ofs)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof block; i++)
+    block[i] = (ofs + i) / 512 + round;
+}
+
+void
+test_main (void) 
+{
+  struct fsstat before, after;
+  char log_buf[LOG_SIZE];
+  size_t ofs;
+  int round;
+  int fd;
+
+  CHECK (fsstat (&before), "fsstat");
+  CHECK (create ("log", 0), "create \"log\"");
+  for (round = 0; round < ROUNDS; round++)
+    {
+      CHECK (create ("big", 0), "create \"big\"");
+      CHECK ((fd = open ("big")) > 1, "open \"big\"");
+      msg ("write \"big\" in round %d", round);
+      for (ofs = 0; ofs < BIG_SIZE; ofs += sizeof block)
+        {
+          fill (round, ofs);
+          if (write (fd, block, sizeof block) != sizeof block)
+            fail ("write %zu bytes at offset %zu in \"big\" failed",
+                  sizeof block, ofs);
+        }
+      msg ("close \"big\"");
+      close (fd);
+
+      CHECK ((fd = open ("big")) > 1, "open \"big\" for verification");
+      for (ofs = 0; ofs < BIG_SIZE; ofs += sizeof block)
+        {
+          fill (round, ofs);
+          if (read (fd, readback, sizeof block) != sizeof block)
+            fail ("read %zu bytes at offset %zu in \"big\" failed",
+                  sizeof block, ofs);
+          compare_bytes (readback, block, sizeof block, ofs, "big");
+        }
+      msg ("verified contents of \"big\"");
+      msg ("close \"big\"");
+      close (fd);
+
+      CHECK ((fd = open ("log")) > 1, "open \"log\"");
+      memset (log_buf, 'a' + round, sizeof log_buf);
+      seek (fd, round * LOG_SIZE);
+      CHECK (write (fd, log_buf, sizeof log_buf) == LOG_SIZE,
+             "write \"log\"");
+      msg ("close \"log\"");
+      close (fd);
+
+      if (round < ROUNDS - 1)
+        CHECK (remove ("big"), "remove \"big\"");
+    }
+  CHECK (fsstat (&after), "fsstat");
+  if (after.journal_commits <= before.journal_commits)
+    fail ("no journal commits");
+}
@@ -0,0 +1,44 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-journal) begin
+(grow-journal) fsstat
+(grow-journal) create "log"
+(grow-journal) create "big"
+(grow-journal) open "big"
+(grow-journal) write "big" in round 0
+(grow-journal) close "big"
+(grow-journal) open "big" for verification
+(grow-journal) verified contents of "big"
+(grow-journal) close "big"
+(grow-journal) open "log"
+(grow-journal) write "log"
+(grow-journal) close "log"
+(grow-journal) remove "big"
+(grow-journal) create "big"
+(grow-journal) open "big"
+(grow-journal) write "big" in round 1
+(grow-journal) close "big"
+(grow-journal) open "big" for verification
+(grow-journal) verified contents of "big"
+(grow-journal) close "big"
+(grow-journal) open "log"
+(grow-journal) write "log"
+(grow-journal) close "log"
+(grow-journal) remove "big"
+(grow-journal) create "big"
+(grow-journal) open "big"
+(grow-journal) write "big" in round 2
+(grow-journal) close "big"
+(grow-journal) open "big" for verification
+(grow-journal) verified contents of "big"
+(grow-journal) close "big"
+(grow-journal) open "log"
+(grow-journal) write "log"
+(grow-journal) close "log"
+(grow-journal) fsstat
+(grow-journal) end
+EOF
+pass;
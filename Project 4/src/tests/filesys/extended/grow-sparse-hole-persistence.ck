@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($head) = random_bytes (1000);
+my ($tail) = random_bytes (200900 - 200123);
+check_archive ({"testfile" => [$head . "\0" x (200123 - 1000) . $tail]});
+pass;
@@ -0,0 +1,47 @@
+/* Writes the start of a file and a block well past its end, then
+   checks that the gap in between reads back as zeros, and that
+   it was read from a hole rather than given blocks on disk. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HEAD_SIZE 1000
+#define TAIL_OFS 200123
+#define FILE_SIZE 200900
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  struct fsstat before, after;
+  long long gap;
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, HEAD_SIZE);
+  random_bytes (buf + TAIL_OFS, FILE_SIZE - TAIL_OFS);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, HEAD_SIZE) == HEAD_SIZE,
+         "write start of \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, TAIL_OFS);
+  CHECK (write (fd, buf + TAIL_OFS, FILE_SIZE - TAIL_OFS)
+         == FILE_SIZE - TAIL_OFS, "write end of \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK (fsstat (&before), "fsstat");
+  check_file (file_name, buf, FILE_SIZE);
+  CHECK (fsstat (&after), "fsstat");
+
+  /* Every whole sector between the two writes is a hole. */
+  gap = (TAIL_OFS / 512 - (HEAD_SIZE + 511) / 512) * 512;
+  if (after.hole_bytes - before.hole_bytes < gap)
+    fail ("%lld bytes of \"%s\" read from holes, expected at least %lld",
+          after.hole_bytes - before.hole_bytes, file_name, gap);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-hole) begin
+(grow-sparse-hole) create "testfile"
+(grow-sparse-hole) open "testfile"
+(grow-sparse-hole) write start of "testfile"
+(grow-sparse-hole) seek "testfile"
+(grow-sparse-hole) write end of "testfile"
+(grow-sparse-hole) close "testfile"
+(grow-sparse-hole) fsstat
+(grow-sparse-hole) open "testfile" for verification
+(grow-sparse-hole) verified contents of "testfile"
+(grow-sparse-hole) close "testfile"
+(grow-sparse-hole) fsstat
+(grow-sparse-hole) end
+EOF
+pass;
@@ -36,8 +36,10 @@
 
 #ifdef FILESYS
 #include "devices/disk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/inode.h"
 #endif
 
 
@@ -50,6 +52,9 @@ uint32_t *base_page_dir;
 #ifdef FILESYS
 /* -f: Format the file system? */
 static bool format_filesys;
+
+/* -crash: Power off without shutting down the file system? */
+static bool crash_filesys;
 #endif
 
 /* -q: Power off after kernel tasks complete? */
@@ -250,7 +255,24 @@ parse_options (char **argv)
         power_off_when_done = true;
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
-        format_filesys = true;
+        {
+          format_filesys = true;
+          if (value == NULL || !strcmp (value, "indexed"))
+            inode_set_format (INODE_INDEXED);
+          else if (!strcmp (value, "extents"))
+            inode_set_format (INODE_EXTENTS);
+          else
+            PANIC ("unknown inode format `%s' (use indexed or extents)", value);
+        }
+      else if (!strcmp (name, "-crash"))
+        crash_filesys = buffer_hold_metadata = true;
+      else if (!strcmp (name, "-cache"))
+        buffer_init_size = atoi (value);
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!buffer_set_policy (value))
+            PANIC ("unknown cache policy `%s' (use clock or 2q)", value);
+        }
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
@@ -360,6 +382,15 @@ usage (void)
           "  -h                 Print this help message and power off.\n"
           "  -q                 Power off VM after actions or on panic.\n"
           "  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+          "  -f=FORMAT          ...with inodes in FORMAT, indexed (default)\n"
+          "                     or extents.\n"
+          "  -crash             Power off as if the power failed, leaving\n"
+          "                     the file system to be recovered.\n"
+          "  -cache=SECTORS     Start the buffer cache at SECTORS sectors.\n"
+          "  -cache-policy=NAME Use buffer cache replacement policy NAME,\n"
+          "                     clock or 2q (default).\n"
+#endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
@@ -379,7 +410,10 @@ power_off (void)
   const char *p;
 
 #ifdef FILESYS
-  filesys_done ();
+  if (crash_filesys)
+    filesys_crash ();
+  else
+    filesys_done ();
 #endif
 
   print_stats ();
@@ -402,6 +436,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   disk_print_stats ();
+  filesys_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -496,6 +496,7 @@ init_thread (struct thread *t, const char *name, int priority)
   
   /* for filesys */
   t->curr_dir = NULL;
+  t->journal_depth = 0;
 
   list_push_back(&all_thread_list, &t->all_elem);
   /* end */
@@ -111,6 +111,7 @@ struct thread
     int is_loaded;
 
     struct dir * curr_dir;
+    int journal_depth;                  /* Nested journal handles. */
 
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
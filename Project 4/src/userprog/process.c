@@ -11,6 +11,7 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
@@ -114,7 +115,13 @@ start_process (void *f_name)
   if_.eflags = FLAG_IF | FLAG_MBS;
   
   //printf("before load\n");
+  /*
+   * load() opens and may close files in this thread, not in the exec()
+   * caller, which only waits for it.
+   */
+  journal_begin();
   success = load (file_name, &if_.eip, &if_.esp);
+  journal_end();
   //printf("after load in start_process\n");
   curr->is_loaded = success;
   sema_up(&exec_sema);
@@ -202,18 +209,26 @@ process_exit (void)
   uint32_t *pd;
   
 //  printf("in process_exit\n");
-  munmap_all();
+  /*
+   * a process killed in the middle of a system call may still be in a journal handle
+   */
+  journal_exit();
 
   /*
-   * close all file_descriptors in current thread's file_list
+   * write back mapped files and close all file_descriptors in current
+   * thread's file_list inside a journal handle, since both may change the file system.
+   * munmap() restarts the handle for each page it writes back.
    */
   struct list_elem * e;
+  journal_begin();
+  munmap_all();
   while(!list_empty(&curr->file_list))
   {
     e = list_begin(&curr->file_list);
     struct file_descriptor * descriptor = list_entry(e, struct file_descriptor, elem);
     close(descriptor->fd);
   }
+  journal_end();
 
   while(!list_empty(&curr->child_list))
   {
@@ -520,16 +535,12 @@ load (const char *file_name, void (**eip) (void), char **esp)
  
   if(success)
   {
-    lock_acquire(&file_lock);
     file_deny_write(file);
-    lock_release(&file_lock);
     thread_current()->executable = file;
   }
   else
   {
-    lock_acquire(&file_lock);
     file_close(file);
-    lock_release(&file_lock);
   }
 
   free(fn_copy);
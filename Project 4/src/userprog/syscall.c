@@ -7,6 +7,7 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "threads/synch.h"
+#include "threads/malloc.h"
 #include "userprog/pagedir.h"
 #include "threads/init.h"
 #include "threads/vaddr.h"
@@ -16,7 +17,9 @@
 #include "filesys/inode.h"
 #include "devices/disk.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "filesys/inode.h"
+#include <string.h>
 
 static void syscall_handler (struct intr_frame *);
 static int get_user(const uint8_t * uaddr);
@@ -37,6 +40,31 @@ check_ptr_validity(void * ptr)
     exit(-1);
 }
 
+/*
+ *  checks the user buffer of SIZE bytes at BUFFER, which the kernel is about
+ *  to write, one page at a time: every page must pass check_ptr_validity, and
+ *  a page that is present must be writable, as in read.
+ */
+static void
+check_buffer_validity(void * buffer, size_t size)
+{
+  struct thread * curr_thread = thread_current();
+  uint8_t * page;
+
+  if(size == 0)
+    return;
+  check_ptr_validity(buffer);
+  if(size > (size_t) ((uint8_t *) PHYS_BASE - (uint8_t *) buffer))
+    exit(-1);
+  for(page = pg_round_down(buffer); page < (uint8_t *) buffer + size; page += PGSIZE)
+  {
+    void * ptr = page < (uint8_t *) buffer ? buffer : page;
+    check_ptr_validity(ptr);
+    if(pagedir_get_page(curr_thread->pagedir, ptr) && !pagedir_is_writable(curr_thread->pagedir, ptr))
+      exit(-1);
+  }
+}
+
 /*
  * get file_descriptor from thread's file_list by linearly checking fd and descriptor->fd
  */
@@ -106,11 +134,12 @@ exit(int status)
     struct thread * parent = get_thread(curr->parent_tid);  
     
     
-    if(!lock_held_by_current_thread(&file_lock)) // when a thread exits, it is possible that the thread has already acquired file_lock.
-      lock_acquire(&file_lock);   
-    
+    /*
+     * the last close of an executable removed meanwhile frees its blocks.
+     */
+    journal_begin();
     file_close(curr->executable);
-    lock_release(&file_lock);
+    journal_end();
     
     struct list_elem * e;
     
@@ -150,9 +179,7 @@ create(const char * file, unsigned initial_size)
   if(!pagedir_get_page(thread_current()->pagedir, file))
     exit(-1);
   int result;
-  lock_acquire(&file_lock);
   result = filesys_create(file, initial_size);
-  lock_release(&file_lock);
   return result;
   
 }
@@ -163,9 +190,7 @@ remove(const char * file)
   check_ptr_validity(file);
   
   int result;
-  lock_acquire(&file_lock);
   result = filesys_remove(file);
-  lock_release(&file_lock);
   return result;
   
 }
@@ -182,9 +207,7 @@ open(const char * file)
   if(fd == 2)
     limit_fd = -1;
 
-  lock_acquire(&file_lock);
   file_ptr = filesys_open(file);
-  lock_release(&file_lock);
  
   if(file_ptr)
   {
@@ -218,9 +241,7 @@ filesize(int fd)
   if(descriptor)
   {
     int result;
-    lock_acquire(&file_lock);
     result = file_length(descriptor->file);
-    lock_release(&file_lock);
     return result;
   }
   return -1; 
@@ -240,24 +261,20 @@ read(int fd, void * buffer, unsigned size)
   if(fd == 0)
   {
     int i=0;
-    lock_acquire(&file_lock);
     while(size)
     {
       *((char *)buffer+i) = input_getc();
       size--;
       i++;
     }
-    lock_release(&file_lock);
     return size;
   }
   if(descriptor)
   {
     int result;
-    lock_acquire(&file_lock);
     if(!descriptor->file)
       return -1;
     result = file_read(descriptor->file, buffer, size);
-    lock_release(&file_lock);
     return result;
   }
 else
@@ -275,9 +292,7 @@ write(int fd, const void * buffer, unsigned size)
   }
   else if(fd == 1)
   {                              // need handling when size > 200
-    lock_acquire(&file_lock);
     putbuf(buffer, size);
-    lock_release(&file_lock);
     return size;
   }
   else if(fd == limit_fd)
@@ -291,10 +306,22 @@ write(int fd, const void * buffer, unsigned size)
       return -1;
     if(descriptor)
     {
-      int result;
-      lock_acquire(&file_lock);
-      result = file_write(descriptor->file, buffer, size);
-      lock_release(&file_lock);
+      int result = 0;
+      /*
+       *  write at most JOURNAL_WRITE_MAX bytes per journal handle, since a handle only has room for so many metadata changes.
+       */
+      while(size > 0)
+      {
+        unsigned chunk = size < JOURNAL_WRITE_MAX ? size : JOURNAL_WRITE_MAX;
+        int written = file_write(descriptor->file, buffer + result, chunk);
+
+        result += written;
+        size -= written;
+        if(written < (int)chunk)
+          break;
+        if(size > 0)
+          journal_restart();
+      }
       return result;
     }
   }
@@ -307,9 +334,7 @@ seek(int fd, unsigned position)
 
   if(descriptor)
   {
-    lock_acquire(&file_lock);
     file_seek(descriptor->file, position);
-    lock_release(&file_lock);
   }
   else
     return;
@@ -323,9 +348,7 @@ tell(int fd)
   if(descriptor)
   {
     unsigned result;
-    lock_acquire(&file_lock);
     result = file_tell(descriptor->file);
-    lock_release(&file_lock);
     return result;
   }
   else
@@ -339,11 +362,9 @@ close(int fd)
 
   if(descriptor)
   {
-    lock_acquire(&file_lock);
     file_close(descriptor->file);
     list_remove(&descriptor->elem);
     free(descriptor);
-    lock_release(&file_lock);
     return;
   }
   else
@@ -372,16 +393,12 @@ mmap(int fd, void * addr)
   int i;
   struct thread * curr = thread_current();
 
-  lock_acquire(&file_lock);
   int f_length = file_length(descriptor->file);
   struct file * f =file_reopen(descriptor->file); // reopen descriptor->file so that when close() called before munmap() called, no list_remove in inode close in close.
-  lock_release(&file_lock);
 
   if(f_length == 0)
   {
-    lock_acquire(&file_lock);
     file_close(f);
-    lock_release(&file_lock);
     return MAP_FAILED;
   }
   int needed_page = f_length / PGSIZE;
@@ -393,9 +410,7 @@ mmap(int fd, void * addr)
     struct spte * spt_entry = spt_find(addr + i*PGSIZE, curr->tid);
     if(spt_entry)  
     {
-      lock_acquire(&file_lock);
       file_close(f);
-      lock_release(&file_lock);
       return MAP_FAILED;
     }
   }
@@ -449,7 +464,6 @@ munmap(mapid_t mapping)
   int page_number = m_info->page_number;
   int i;
 
-  lock_acquire(&file_lock);
   for(i=0; i<page_number; i++)
   {
     /*   if page at addr + i*PGSIZE is dirty, write it at file.
@@ -458,6 +472,7 @@ munmap(mapid_t mapping)
      */
     if(pagedir_is_dirty(curr->pagedir, addr))
     {
+      journal_restart(); // each page in a journal handle of its own.
       file_write_at(f, addr, PGSIZE, i*PGSIZE);
 
       struct fte * frame_entry = frame_find(addr, curr->tid, false);
@@ -468,7 +483,6 @@ munmap(mapid_t mapping)
   }
   
   file_close(f);
-  lock_release(&file_lock);
 
   list_remove(&m_info->elem);
   free(m_info);
@@ -493,7 +507,8 @@ mkdir(const char * dir)
 
   success = (directory != NULL
           && !dir_lookup(directory, real_name, &inode)
-          && free_map_allocate_one(&inode_sector)
+          && free_map_allocate_inode(inode_get_inumber(dir_get_inode(directory)),
+                                     true, &inode_sector)
           && dir_create(inode_sector, 16)
           && dir_add(directory, real_name, inode_sector));
   
@@ -589,6 +604,62 @@ isdir(int fd)
 
 }
 
+/*
+ *  copies file system statistics to user buffer ST.
+ *  they are gathered into a kernel copy first, so that a page fault on ST
+ *  cannot happen while the buffer cache is locked.
+ */
+bool
+fsstat(struct fsstat * st)
+{
+  struct fsstat kst;
+
+  check_buffer_validity(st, sizeof *st);
+  filesys_get_stats(&kst);
+  memcpy(st, &kst, sizeof kst);
+  return true;
+}
+
+/*
+ *  copies up to CNT entries of directory FD to user buffer ENTS, and returns
+ *  how many, which is 0 at the end of the directory, or -1 if FD is not an
+ *  open directory.  entries are gathered into a kernel buffer GETDENTS_CHUNK
+ *  at a time, as in fsstat.
+ */
+#define GETDENTS_CHUNK 64
+int
+getdents(int fd, struct dirent * ents, unsigned cnt)
+{
+  struct file_descriptor * descriptor = get_fileptr(fd);
+  struct dirent * kents;
+  unsigned done = 0;
+  size_t want, n;
+
+  if(cnt == 0)
+    return 0;
+  check_ptr_validity(ents);
+  if(cnt > (unsigned) ((char *) PHYS_BASE - (char *) ents) / sizeof *ents)
+    exit(-1);
+  check_buffer_validity(ents, cnt * sizeof *ents);
+  if(descriptor == NULL || descriptor->dir == NULL)
+    return -1;
+
+  kents = malloc(GETDENTS_CHUNK * sizeof *kents);
+  if(kents == NULL)
+    return -1;
+  while(done < cnt)
+  {
+    want = cnt - done < GETDENTS_CHUNK ? cnt - done : GETDENTS_CHUNK;
+    n = dir_getdents(descriptor->dir, kents, want);
+    memcpy(ents + done, kents, n * sizeof *kents);
+    done += n;
+    if(n < want)
+      break;
+  }
+  free(kents);
+  return done;
+}
+
 /* Reads a byte at user virtual address UADDR.
  * UADDR must be below PHYS_BASE.
  * Returns the byte value if successful, -1 if a segfault
@@ -657,7 +728,6 @@ get_arg(char * ptr)
 void
 syscall_init (void) 
 {
-  lock_init(&file_lock);
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -681,13 +751,19 @@ syscall_handler (struct intr_frame *f )
     f->eax = (uint32_t) process_wait(get_arg(f->esp+4));
     break;
 	case SYS_CREATE : 
+    journal_begin();
     f->eax = create((char *)get_arg(f->esp+4), (unsigned)get_arg(f->esp+8));
+    journal_end();
     break;
 	case SYS_REMOVE : 
+    journal_begin();
     f->eax = remove((char *)get_arg(f->esp+4));
+    journal_end();
     break;
 	case SYS_OPEN : 
+    journal_begin();
     f->eax = open((char *)get_arg(f->esp+4));
+    journal_end();
     break;
 	case SYS_FILESIZE : 
     f->eax = filesize((int)get_arg(f->esp+4));
@@ -696,7 +772,9 @@ syscall_handler (struct intr_frame *f )
     f->eax = read((int)get_arg(f->esp+4), (void *)get_arg(f->esp+8), get_arg(f->esp+12));
     break;
 	case SYS_WRITE :
+    journal_begin();
     f->eax = write((int)get_arg(f->esp+4), (void *)get_arg(f->esp+8), get_arg(f->esp+12));
+    journal_end();
     break;
 	case SYS_SEEK :
     seek((int)get_arg(f->esp+4), get_arg(f->esp+8));
@@ -705,24 +783,36 @@ syscall_handler (struct intr_frame *f )
     f->eax = tell((int)get_arg(f->esp+4));
     break;
 	case SYS_CLOSE : 
+    journal_begin();
     close((int)get_arg(f->esp+4));
+    journal_end();
     break;
 #ifdef VM
   case SYS_MMAP :
+    journal_begin();
     f->eax = mmap((int)get_arg(f->esp+4), (void *)get_arg(f->esp+8));
+    journal_end();
     break;
   case SYS_MUNMAP :
+    journal_begin();
     munmap((mapid_t)get_arg(f->esp+4));
+    journal_end();
     break;
 #endif
   case SYS_MKDIR:
+    journal_begin();
     f->eax = mkdir((char *)get_arg(f->esp+4));
+    journal_end();
     break;
   case SYS_CHDIR:
+    journal_begin();
     f->eax = chdir((char *)get_arg(f->esp+4));
+    journal_end();
     break;
   case SYS_READDIR:
+    journal_begin();
     f->eax = readdir((int)get_arg(f->esp+4), (char *)get_arg(f->esp+8));
+    journal_end();
     break;
   case SYS_INUMBER:
     f->eax = inumber((int)get_arg(f->esp+4));
@@ -730,6 +820,15 @@ syscall_handler (struct intr_frame *f )
   case SYS_ISDIR:
     f->eax = isdir((int)get_arg(f->esp+4));
     break;
+  case SYS_FSSTAT:
+    f->eax = fsstat((struct fsstat *)get_arg(f->esp+4));
+    break;
+  case SYS_GETDENTS:
+    journal_begin();
+    f->eax = getdents((int)get_arg(f->esp+4), (struct dirent *)get_arg(f->esp+8),
+                      (unsigned)get_arg(f->esp+12));
+    journal_end();
+    break;
   default : //break;
  	  printf ("system call!\n");
     thread_exit ();
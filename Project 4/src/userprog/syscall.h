@@ -5,7 +5,6 @@
 
 void syscall_init (void);
 
-struct lock file_lock;
 int limit_fd;
 
 void check_ptr_validity(void *);